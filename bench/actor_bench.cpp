@@ -0,0 +1,142 @@
+// Actors versus one green thread per actor.
+//
+// The main thread sends MESSAGES messages spread evenly over N receivers
+// and reports the creation cost per receiver and messages/sec until every
+// message has been handled. A thread-per-actor receiver blocks in sem_wait
+// on its own mailbox semaphore, so each message is one sem_post. An actor
+// receiver is a uthread_actor served by the default pool of 4 workers.
+//
+// Thread-per-actor is limited to one run of THREAD_LIMIT receivers. The TCB
+// array holds MAX_THREADS (150) entries including main, joined threads do
+// not free their entry, and the actor workers need 4 more.
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct uthread_actor uthread_actor_t;
+uthread_actor_t *uthread_actor_create(void (*handler)(uthread_actor_t *self, void *state,
+                                                      void *msg),
+                                      void *state);
+int uthread_actor_send(uthread_actor_t *actor, void *msg);
+int uthread_actor_stop(uthread_actor_t *actor);
+
+#define MESSAGES 1000000L
+#define THREAD_LIMIT 145
+
+static long per_receiver;
+static long handled;
+static sem_t done;
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, int n, double create, double elapsed)
+{
+    printf("%-8s %7d receivers  %8.2f us/create  %12.0f msgs/s\n", name, n,
+           create * 1e6 / n, n * per_receiver / elapsed);
+}
+
+static void* receiver(void* arg)
+{
+    sem_t* mailbox = (sem_t*)arg;
+    for (long i = 0; i < per_receiver; i++) {
+        sem_wait(mailbox);
+    }
+    return NULL;
+}
+
+static void run_threads(int n)
+{
+    per_receiver = MESSAGES / n;
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * n);
+    sem_t* mailboxes = (sem_t*)malloc(sizeof(sem_t) * n);
+    for (int i = 0; i < n; i++) {
+        sem_init(&mailboxes[i], 0, 0);
+    }
+
+    double start = seconds();
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, receiver, &mailboxes[i]) != 0) {
+            printf("pthread_create failed at %d\n", i);
+            exit(1);
+        }
+    }
+    double created = seconds();
+    for (long m = 0; m < per_receiver; m++) {
+        for (int i = 0; i < n; i++) {
+            sem_post(&mailboxes[i]);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report("threads", n, created - start, seconds() - created);
+
+    for (int i = 0; i < n; i++) {
+        sem_destroy(&mailboxes[i]);
+    }
+    free(mailboxes);
+    free(threads);
+}
+
+static void handler(uthread_actor_t* self, void* state, void* msg)
+{
+    (void)self;
+    (void)msg;
+    (*(long*)state)++;
+    if (__atomic_add_fetch(&handled, 1, __ATOMIC_RELAXED) == MESSAGES) {
+        sem_post(&done);
+    }
+}
+
+static void run_actors(int n)
+{
+    per_receiver = MESSAGES / n;
+    __atomic_store_n(&handled, MESSAGES - n * per_receiver, __ATOMIC_RELAXED);
+    uthread_actor_t** actors = (uthread_actor_t**)malloc(sizeof(uthread_actor_t*) * n);
+    long* counts = (long*)calloc(n, sizeof(long));
+
+    double start = seconds();
+    for (int i = 0; i < n; i++) {
+        actors[i] = uthread_actor_create(handler, &counts[i]);
+        if (actors[i] == NULL) {
+            printf("uthread_actor_create failed at %d\n", i);
+            exit(1);
+        }
+    }
+    double created = seconds();
+    for (long m = 0; m < per_receiver; m++) {
+        for (int i = 0; i < n; i++) {
+            uthread_actor_send(actors[i], (void*)1);
+        }
+    }
+    sem_wait(&done);
+    report("actors", n, created - start, seconds() - created);
+
+    for (int i = 0; i < n; i++) {
+        if (counts[i] != per_receiver) {
+            printf("actor %d handled %ld of %ld\n", i, counts[i], per_receiver);
+        }
+        uthread_actor_stop(actors[i]);
+    }
+    free(counts);
+    free(actors);
+}
+
+int main()
+{
+    sem_init(&done, 0, 0);
+    printf("%ld messages per run\n", MESSAGES);
+    run_threads(THREAD_LIMIT);
+    run_actors(THREAD_LIMIT);
+    run_actors(1000);
+    run_actors(10000);
+    run_actors(100000);
+    return 0;
+}
@@ -0,0 +1,280 @@
+// Loopback echo server, one green thread per connection, driven by an
+// open-loop load generator.
+//
+// Usage: ./echo_bench [requests/sec] [seconds]
+//
+// Each run forks a fresh server process, opens N connections to it and
+// sends REQUEST_SIZE-byte requests at a fixed total rate, round-robin over
+// the connections, whether or not earlier replies have arrived. Latency is
+// measured from each request's scheduled send time, so a stalled server
+// shows up in the percentiles instead of slowing the generator down
+// (coordinated-omission correction). Requests without a reply a second
+// after the last send are reported as lost.
+//
+// The generator process never calls into the library, so it runs as a
+// plain Linux program and is not preempted by the scheduler's timer. The
+// server gets a fresh process per run because the TCB array has
+// MAX_THREADS (150) entries including main, and joined threads do not
+// free their entry. That caps the sweep at MAX_CONNECTIONS.
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int uthread_wait_fd(int fd, unsigned int events, int timeout_ms);
+int uthread_close(int fd);
+
+#define REQUEST_SIZE 64
+#define MAX_CONNECTIONS 140
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Server side
+
+static void* echo_connection(void* arg)
+{
+    int fd = (int)(long)arg;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            if (errno != EAGAIN) {
+                break;
+            }
+            uthread_wait_fd(fd, EPOLLIN | EPOLLRDHUP, -1);
+            continue;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t m = write(fd, buf + done, n - done);
+            if (m >= 0) {
+                done += m;
+            } else if (errno == EAGAIN) {
+                uthread_wait_fd(fd, EPOLLOUT, -1);
+            } else {
+                break;
+            }
+        }
+    }
+    uthread_close(fd);
+    return NULL;
+}
+
+static void serve(int listen_fd, int connections)
+{
+    pthread_t threads[MAX_CONNECTIONS];
+    for (int i = 0; i < connections; ) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            uthread_wait_fd(listen_fd, EPOLLIN, -1);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (pthread_create(&threads[i], NULL, echo_connection, (void*)(long)fd) != 0) {
+            fprintf(stderr, "server: pthread_create failed at %d\n", i);
+            exit(1);
+        }
+        i++;
+    }
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Generator side
+
+struct Connection {
+    int fd;
+    unsigned long long* scheduled;  // send times of outstanding requests
+    long head, tail;                // scheduled[head..tail) await a reply
+    long received;                  // bytes of the oldest reply seen so far
+    long unsent;                    // request bytes not yet written
+};
+
+static int compare(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void flush(Connection* c)
+{
+    static char zeros[REQUEST_SIZE * 64];
+    while (c->unsent > 0) {
+        long chunk = (c->unsent < (long)sizeof(zeros)) ? c->unsent : (long)sizeof(zeros);
+        ssize_t n = write(c->fd, zeros, chunk);
+        if (n <= 0) {
+            return;
+        }
+        c->unsent -= n;
+    }
+}
+
+static void run(int listen_fd, struct sockaddr_in* addr, int connections, long rate,
+                double duration)
+{
+    fflush(stdout);
+    pid_t server = fork();
+    if (server == 0) {
+        serve(listen_fd, connections);
+        exit(0);
+    }
+
+    long total = (long)(rate * duration);
+    Connection* conns = (Connection*)calloc(connections, sizeof(Connection));
+    unsigned long long* latencies = (unsigned long long*)malloc(sizeof(unsigned long long) *
+                                                                total);
+    int epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    for (int i = 0; i < connections; i++) {
+        Connection* c = &conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (connect(c->fd, (struct sockaddr*)addr, sizeof(*addr)) == -1 &&
+            errno != EINPROGRESS) {
+            perror("connect");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->scheduled = (unsigned long long*)malloc(sizeof(unsigned long long) *
+                                                   (total / connections + 1));
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = connections;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    // Request i is due at start + i / rate, on connection i % connections
+    unsigned long long start = now_ns() + 100000000ULL;
+    unsigned long long deadline = start + (unsigned long long)(duration * 1e9) + 1000000000ULL;
+    unsigned long long last_reply = start;
+    long sent = 0, completed = 0;
+    char buf[65536];
+    while (completed < total) {
+        unsigned long long now = now_ns();
+        while (sent < total && start + (unsigned long long)(sent * 1e9 / rate) <= now) {
+            Connection* c = &conns[sent % connections];
+            c->scheduled[c->tail++] = start + (unsigned long long)(sent * 1e9 / rate);
+            c->unsent += REQUEST_SIZE;
+            sent++;
+        }
+        for (int i = 0; i < connections; i++) {
+            flush(&conns[i]);
+        }
+        if (now >= deadline) {
+            break;
+        }
+
+        struct itimerspec wake;
+        memset(&wake, 0, sizeof(wake));
+        unsigned long long next = (sent < total)
+            ? start + (unsigned long long)(sent * 1e9 / rate) : deadline;
+        if (next <= now) {
+            continue;
+        }
+        // A pending write also needs EPOLLOUT; polling again after 100us is enough
+        for (int i = 0; i < connections; i++) {
+            if (conns[i].unsent > 0 && next > now + 100000) {
+                next = now + 100000;
+            }
+        }
+        wake.it_value.tv_sec = next / 1000000000ULL;
+        wake.it_value.tv_nsec = next % 1000000000ULL;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &wake, NULL);
+
+        struct epoll_event events[256];
+        int ready = epoll_wait(epoll_fd, events, 256, -1);
+        now = now_ns();
+        for (int e = 0; e < ready; e++) {
+            if ((int)events[e].data.u32 == connections) {
+                unsigned long long expirations;
+                ssize_t drained = read(timer_fd, &expirations, sizeof(expirations));
+                (void)drained;
+                continue;
+            }
+            Connection* c = &conns[events[e].data.u32];
+            ssize_t n;
+            while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+                c->received += n;
+                while (c->received >= REQUEST_SIZE && c->head < c->tail) {
+                    c->received -= REQUEST_SIZE;
+                    latencies[completed++] = now - c->scheduled[c->head++];
+                    last_reply = now;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < connections; i++) {
+        close(conns[i].fd);
+        free(conns[i].scheduled);
+    }
+    close(timer_fd);
+    close(epoll_fd);
+    free(conns);
+    waitpid(server, NULL, 0);
+
+    qsort(latencies, completed, sizeof(unsigned long long), compare);
+    double elapsed = (last_reply - start) / 1e9;
+    if (completed == 0) {
+        printf("%5d conns  no replies\n", connections);
+    } else {
+        printf("%5d conns  %9.0f req/s  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  "
+               "lost %ld\n", connections, completed / elapsed,
+               latencies[(long)(completed * 0.50)] / 1e3,
+               latencies[(long)(completed * 0.99)] / 1e3,
+               latencies[(long)(completed * 0.999)] / 1e3, total - completed);
+    }
+    free(latencies);
+}
+
+int main(int argc, char** argv)
+{
+    long rate = (argc > 1) ? atol(argv[1]) : 20000;
+    double duration = (argc > 2) ? atof(argv[2]) : 2.0;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 256) == -1 ||
+        getsockname(listen_fd, (struct sockaddr*)&addr, &len) == -1) {
+        perror("listen");
+        return 1;
+    }
+
+    printf("%ld requests/s offered for %.1f s, %d-byte requests\n", rate, duration,
+           REQUEST_SIZE);
+    int sweep[] = { 10, 20, 40, 80, MAX_CONNECTIONS };
+    for (unsigned i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++) {
+        run(listen_fd, &addr, sweep[i], rate, duration);
+    }
+    close(listen_fd);
+    return 0;
+}
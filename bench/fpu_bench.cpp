@@ -0,0 +1,137 @@
+// Context switch cost with per-thread FPU control state.
+//
+// THREADS threads pass a token around a ring of semaphores, doing a little
+// floating-point work per hop, and report ns per handoff. Each handoff is
+// one voluntary switch. Workloads:
+//   scalar - every thread does scalar double math in the default state
+//   avx2   - every thread does AVX2 FMAs with FTZ/DAZ set in MXCSR, as
+//            SIMD kernels usually do
+//   mix    - alternating scalar and AVX2 threads, so every switch changes
+//            MXCSR
+// Build as fpu_bench (lazy, the default) and fpu_bench_eager (library and
+// program compiled with -DUTHREAD_FPU_EAGER) and compare. Each thread also
+// checks that its MXCSR survived every switch.
+#include <immintrin.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <time.h>
+
+#define THREADS 4
+#define ROUNDS 200000
+#define FTZ_DAZ 0x8040
+
+enum Kind { SCALAR, AVX2 };
+
+static sem_t turn[THREADS];
+static Kind kinds[THREADS];
+static double results[THREADS];
+static long corrupted;
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double scalar_work(double x)
+{
+    for (int i = 0; i < 16; i++) {
+        x = x * 1.0000001 + 0.5;
+    }
+    return x;
+}
+
+__attribute__((target("avx2,fma"))) static double avx2_work(__m256d* acc)
+{
+    __m256d scale = _mm256_set1_pd(1.0000001);
+    __m256d add = _mm256_set1_pd(0.5);
+    for (int i = 0; i < 4; i++) {
+        *acc = _mm256_fmadd_pd(*acc, scale, add);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, *acc);
+    return lanes[0];
+}
+
+__attribute__((target("avx2,fma"))) static void* avx2_thread(int id)
+{
+    _mm_setcsr(_mm_getcsr() | FTZ_DAZ);
+    unsigned int mxcsr = _mm_getcsr();
+    __m256d acc = _mm256_set1_pd(id);
+    double last = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        sem_wait(&turn[id]);
+        if (_mm_getcsr() != mxcsr) {
+            __atomic_add_fetch(&corrupted, 1, __ATOMIC_RELAXED);
+        }
+        last = avx2_work(&acc);
+        sem_post(&turn[(id + 1) % THREADS]);
+    }
+    results[id] = last;
+    return NULL;
+}
+
+static void* scalar_thread(int id)
+{
+    unsigned int mxcsr = _mm_getcsr();
+    double x = id;
+    for (int r = 0; r < ROUNDS; r++) {
+        sem_wait(&turn[id]);
+        if (_mm_getcsr() != mxcsr) {
+            __atomic_add_fetch(&corrupted, 1, __ATOMIC_RELAXED);
+        }
+        x = scalar_work(x);
+        sem_post(&turn[(id + 1) % THREADS]);
+    }
+    results[id] = x;
+    return NULL;
+}
+
+static void* worker(void* arg)
+{
+    int id = (int)(long)arg;
+    return (kinds[id] == AVX2) ? avx2_thread(id) : scalar_thread(id);
+}
+
+static void run(const char* name, Kind even, Kind odd)
+{
+    corrupted = 0;
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        kinds[i] = (i % 2 == 0) ? even : odd;
+        sem_init(&turn[i], 0, 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void*)(long)i);
+    }
+    double start = seconds();
+    sem_post(&turn[0]);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = seconds() - start;
+    printf("%-7s %7.1f ns/switch  %s\n", name, elapsed * 1e9 / ((double)ROUNDS * THREADS),
+           (corrupted == 0) ? "ok" : "MXCSR LOST");
+    for (int i = 0; i < THREADS; i++) {
+        sem_destroy(&turn[i]);
+    }
+}
+
+int main()
+{
+#ifdef UTHREAD_FPU_EAGER
+    printf("eager FPU state, %d threads, %d rounds\n", THREADS, ROUNDS);
+#else
+    printf("lazy FPU state, %d threads, %d rounds\n", THREADS, ROUNDS);
+#endif
+    run("scalar", SCALAR, SCALAR);
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma")) {
+        printf("no AVX2/FMA on this CPU, skipping avx2 and mix\n");
+        return 0;
+    }
+    run("avx2", AVX2, AVX2);
+    run("mix", SCALAR, AVX2);
+    return 0;
+}
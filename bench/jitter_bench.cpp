@@ -0,0 +1,123 @@
+// Release jitter of periodic threads.
+//
+// A thread wakes every PERIOD_NS for ITERATIONS releases and records how
+// late each wakeup was against its ideal release time. Runs with the
+// process otherwise idle and with a CPU-bound thread competing, for:
+//   periodic  - uthread_periodic_wait
+//   abstime   - clock_nanosleep(TIMER_ABSTIME) to t0 + k * period
+//   relative  - nanosleep(period), which drifts; reported as the total
+//               drift after the last release
+//   kernel    - the kernel's clock_nanosleep called directly, which blocks
+//               the whole process; the floor set by the machine itself
+// Releases skipped by uthread_periodic after an overrun are left out.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct uthread_periodic uthread_periodic_t;
+uthread_periodic_t *uthread_periodic_create(unsigned long long period_ns);
+int uthread_periodic_wait(uthread_periodic_t *periodic);
+unsigned long uthread_periodic_releases(uthread_periodic_t *periodic);
+unsigned long uthread_periodic_overruns(uthread_periodic_t *periodic);
+int uthread_periodic_destroy(uthread_periodic_t *periodic);
+
+#define PERIOD_NS 1000000ULL
+#define ITERATIONS 1000
+
+enum Mode { PERIODIC, ABSTIME, RELATIVE, KERNEL };
+
+static bool stop_spinning;
+static unsigned long long lateness[ITERATIONS];
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* spinner(void* arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&stop_spinning, __ATOMIC_RELAXED)) {
+    }
+    return NULL;
+}
+
+static int compare(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+static void run(Mode mode, bool busy)
+{
+    pthread_t spin;
+    if (busy) {
+        __atomic_store_n(&stop_spinning, false, __ATOMIC_RELAXED);
+        pthread_create(&spin, NULL, spinner, NULL);
+    }
+
+    const char* names[] = { "periodic", "abstime", "relative", "kernel" };
+    const char* load = busy ? "busy" : "idle";
+    unsigned long releases = ITERATIONS, overruns = 0;
+    unsigned long long skipped = 0;
+    unsigned long long t0 = now_ns();
+    uthread_periodic_t* periodic = (mode == PERIODIC) ? uthread_periodic_create(PERIOD_NS)
+                                                      : NULL;
+    for (int k = 1; k <= ITERATIONS; k++) {
+        unsigned long long release = t0 + (k + skipped) * PERIOD_NS;
+        struct timespec deadline = { (time_t)(release / 1000000000ULL),
+                                     (long)(release % 1000000000ULL) };
+        if (mode == PERIODIC) {
+            skipped += uthread_periodic_wait(periodic);
+            release = t0 + (k + skipped) * PERIOD_NS;
+        } else if (mode == ABSTIME) {
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        } else if (mode == KERNEL) {
+            syscall(SYS_clock_nanosleep, CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        } else {
+            struct timespec delay = { 0, (long)PERIOD_NS };
+            nanosleep(&delay, NULL);
+        }
+        unsigned long long now = now_ns();
+        lateness[k - 1] = (now > release) ? now - release : 0;
+    }
+    if (periodic != NULL) {
+        releases = uthread_periodic_releases(periodic);
+        overruns = uthread_periodic_overruns(periodic);
+        uthread_periodic_destroy(periodic);
+    }
+
+    if (busy) {
+        __atomic_store_n(&stop_spinning, true, __ATOMIC_RELAXED);
+        pthread_join(spin, NULL);
+    }
+
+    if (mode == RELATIVE) {
+        printf("%-9s %s  drift after %d periods %9.1f us\n", names[mode], load, ITERATIONS,
+               lateness[ITERATIONS - 1] / 1e3);
+        return;
+    }
+    qsort(lateness, ITERATIONS, sizeof(lateness[0]), compare);
+    printf("%-9s %s  p50 %7.1f us  p99 %7.1f us  max %8.1f us  missed %lu/%lu\n",
+           names[mode], load, lateness[ITERATIONS / 2] / 1e3,
+           lateness[ITERATIONS * 99 / 100] / 1e3, lateness[ITERATIONS - 1] / 1e3, overruns,
+           releases + overruns);
+}
+
+int main()
+{
+    printf("%d releases every %llu us\n", ITERATIONS, PERIOD_NS / 1000);
+    run(KERNEL, false);
+    for (int busy = 0; busy <= 1; busy++) {
+        run(PERIODIC, busy);
+        run(ABSTIME, busy);
+        run(RELATIVE, busy);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Pipeline throughput versus stage count.
+//
+// Pushes ITEMS items through pipelines of 1 to 16 stages, one worker per
+// stage, and reports items/sec from the first push to the end of close.
+// Each stage does a trivial amount of work so the figures show the cost of
+// moving items between stages. Runs with per-item handoff (batch 1) and
+// with batches of BATCH.
+#include <stdio.h>
+#include <time.h>
+
+typedef struct uthread_pipeline uthread_pipeline_t;
+uthread_pipeline_t *uthread_pipeline_create(void);
+int uthread_pipeline_add_stage(uthread_pipeline_t *p, void *(*fn)(void *item, void *ctx),
+                               void *ctx, int parallelism, unsigned long capacity, int batch);
+int uthread_pipeline_start(uthread_pipeline_t *p);
+int uthread_pipeline_push_batch(uthread_pipeline_t *p, void **items, int n);
+int uthread_pipeline_close(uthread_pipeline_t *p);
+int uthread_pipeline_destroy(uthread_pipeline_t *p);
+
+#define ITEMS 1000000L
+#define CAPACITY 1024
+#define BATCH 32
+
+static void* stage(void* item, void* ctx)
+{
+    (void)ctx;
+    return item;
+}
+
+static void* sink(void* item, void* ctx)
+{
+    (*(long*)ctx)++;
+    return item;
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(int stages, int batch)
+{
+    long received = 0;
+    uthread_pipeline_t* pipeline = uthread_pipeline_create();
+    for (int i = 0; i < stages - 1; i++) {
+        uthread_pipeline_add_stage(pipeline, stage, NULL, 1, CAPACITY, batch);
+    }
+    uthread_pipeline_add_stage(pipeline, sink, &received, 1, CAPACITY, batch);
+    if (uthread_pipeline_start(pipeline) != 0) {
+        printf("uthread_pipeline_start failed\n");
+        return;
+    }
+
+    void* items[BATCH];
+    double start = seconds();
+    for (long i = 0; i < ITEMS; i += batch) {
+        for (int j = 0; j < batch; j++) {
+            items[j] = (void*)(i + j + 1);
+        }
+        uthread_pipeline_push_batch(pipeline, items, batch);
+    }
+    uthread_pipeline_close(pipeline);
+    double elapsed = seconds() - start;
+
+    printf("%2d stages  batch %2d  %12.0f items/s  %12.0f stage-items/s  %s\n", stages,
+           batch, ITEMS / elapsed, ITEMS * stages / elapsed,
+           (received == ITEMS) ? "ok" : "LOST ITEMS");
+    uthread_pipeline_destroy(pipeline);
+}
+
+int main()
+{
+    printf("%ld items, queues of %d\n", ITEMS, CAPACITY);
+    for (int stages = 1; stages <= 16; stages *= 2) {
+        run(stages, 1);
+        run(stages, BATCH);
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+// Lock-free queues versus the README's semaphore-guarded buffer.
+//
+// Moves ITEMS pointers from producers to consumers through a bounded
+// buffer of CAPACITY slots and reports items/sec for:
+//   sem     - array guarded by sem_wait(empty) / store / sem_post(full),
+//             plus a mutex semaphore when there are several producers or
+//             consumers (the README's producer-consumer pattern)
+//   spsc    - uthread_spsc push/pop, and batches of BATCH
+//   mpmc    - uthread_mpmc push/pop, and batches of BATCH
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct uthread_spsc uthread_spsc_t;
+typedef struct uthread_mpmc uthread_mpmc_t;
+uthread_spsc_t *uthread_spsc_create(unsigned long capacity);
+void uthread_spsc_destroy(uthread_spsc_t *q);
+void uthread_spsc_push(uthread_spsc_t *q, void *item);
+void *uthread_spsc_pop(uthread_spsc_t *q);
+void uthread_spsc_push_batch(uthread_spsc_t *q, void **items, int n);
+int uthread_spsc_pop_batch(uthread_spsc_t *q, void **items, int max);
+uthread_mpmc_t *uthread_mpmc_create(unsigned long capacity);
+void uthread_mpmc_destroy(uthread_mpmc_t *q);
+void uthread_mpmc_push(uthread_mpmc_t *q, void *item);
+void *uthread_mpmc_pop(uthread_mpmc_t *q);
+void uthread_mpmc_push_batch(uthread_mpmc_t *q, void **items, int n);
+int uthread_mpmc_pop_batch(uthread_mpmc_t *q, void **items, int max);
+
+#define ITEMS 2000000L
+#define CAPACITY 1024
+#define BATCH 32
+
+enum Kind { SEM, SPSC, SPSC_BATCH, MPMC, MPMC_BATCH };
+
+static Kind kind;
+static long per_producer;
+static long per_consumer;
+
+// README pattern
+static void* buffer[CAPACITY];
+static int head = 0, tail = 0;
+static sem_t empty, full, mutex;
+
+static uthread_spsc_t* spsc;
+static uthread_mpmc_t* mpmc;
+
+static void sem_put(void* item)
+{
+    sem_wait(&empty);
+    sem_wait(&mutex);
+    buffer[tail] = item;
+    tail = (tail + 1) % CAPACITY;
+    sem_post(&mutex);
+    sem_post(&full);
+}
+
+static void* sem_get()
+{
+    sem_wait(&full);
+    sem_wait(&mutex);
+    void* item = buffer[head];
+    head = (head + 1) % CAPACITY;
+    sem_post(&mutex);
+    sem_post(&empty);
+    return item;
+}
+
+static void* producer(void* arg)
+{
+    long base = (long)arg * per_producer;
+    void* items[BATCH];
+    for (long i = 0; i < per_producer; ) {
+        long value = base + i + 1;
+        switch (kind) {
+        case SEM: sem_put((void*)value); i++; break;
+        case SPSC: uthread_spsc_push(spsc, (void*)value); i++; break;
+        case MPMC: uthread_mpmc_push(mpmc, (void*)value); i++; break;
+        case SPSC_BATCH:
+        case MPMC_BATCH: {
+            int n = 0;
+            while (n < BATCH && i < per_producer) {
+                items[n++] = (void*)(base + ++i);
+            }
+            if (kind == SPSC_BATCH) {
+                uthread_spsc_push_batch(spsc, items, n);
+            } else {
+                uthread_mpmc_push_batch(mpmc, items, n);
+            }
+            break;
+        }
+        }
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg)
+{
+    long sum = 0;
+    void* items[BATCH];
+    for (long got = 0; got < per_consumer; ) {
+        switch (kind) {
+        case SEM: sum += (long)sem_get(); got++; break;
+        case SPSC: sum += (long)uthread_spsc_pop(spsc); got++; break;
+        case MPMC: sum += (long)uthread_mpmc_pop(mpmc); got++; break;
+        case SPSC_BATCH:
+        case MPMC_BATCH: {
+            int max = (per_consumer - got < BATCH) ? (int)(per_consumer - got) : BATCH;
+            int n = (kind == SPSC_BATCH) ? uthread_spsc_pop_batch(spsc, items, max)
+                                         : uthread_mpmc_pop_batch(mpmc, items, max);
+            for (int j = 0; j < n; j++) {
+                sum += (long)items[j];
+            }
+            got += n;
+            break;
+        }
+        }
+    }
+    *(long*)arg = sum;
+    return NULL;
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char* name, Kind k, int producers, int consumers)
+{
+    kind = k;
+    per_producer = ITEMS / producers;
+    per_consumer = ITEMS / consumers;
+    sem_init(&empty, 0, CAPACITY);
+    sem_init(&full, 0, 0);
+    sem_init(&mutex, 0, 1);
+    head = tail = 0;
+    spsc = uthread_spsc_create(CAPACITY);
+    mpmc = uthread_mpmc_create(CAPACITY);
+
+    pthread_t threads[16];
+    long sums[8];
+    double start = seconds();
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, consumer, &sums[i]);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&threads[consumers + i], NULL, producer, (void*)(long)i);
+    }
+    for (int i = 0; i < producers + consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = seconds() - start;
+
+    long sum = 0;
+    for (int i = 0; i < consumers; i++) {
+        sum += sums[i];
+    }
+    long expect = ITEMS * (ITEMS + 1) / 2;
+    printf("%-12s %dP/%dC  %12.0f items/s  %7.1f ns/item  %s\n", name, producers,
+           consumers, ITEMS / elapsed, elapsed * 1e9 / ITEMS,
+           (sum == expect) ? "ok" : "WRONG SUM");
+
+    uthread_spsc_destroy(spsc);
+    uthread_mpmc_destroy(mpmc);
+    sem_destroy(&empty);
+    sem_destroy(&full);
+    sem_destroy(&mutex);
+}
+
+int main()
+{
+    printf("%ld items through a %d-slot buffer, batches of %d\n", ITEMS, CAPACITY, BATCH);
+    run("sem", SEM, 1, 1);
+    run("spsc", SPSC, 1, 1);
+    run("spsc batch", SPSC_BATCH, 1, 1);
+    run("sem", SEM, 4, 4);
+    run("mpmc", MPMC, 4, 4);
+    run("mpmc batch", MPMC_BATCH, 4, 4);
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Stride scheduling shares: three CPU-bound threads with 70, 20 and 10
+// tickets run for a few seconds, then each thread's uthread_runtime_ns is
+// reported as a share of the total next to the share its tickets ask for.
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+enum uthread_sched_policy { UTHREAD_SCHED_ROUND_ROBIN, UTHREAD_SCHED_STRIDE };
+int uthread_set_sched_policy(int policy);
+int uthread_set_tickets(pthread_t thread, unsigned int tickets);
+unsigned long long uthread_runtime_ns(pthread_t thread);
+
+#define SECONDS 5
+
+volatile int stop = 0;
+
+void* spin(void* arg) {
+    (void)arg;
+    while (!stop) {
+    }
+    return NULL;
+}
+
+int main() {
+    unsigned int tickets[3] = { 70, 20, 10 };
+    pthread_t threads[3];
+
+    uthread_set_sched_policy(UTHREAD_SCHED_STRIDE);
+    for (int i = 0; i < 3; i++) {
+        pthread_create(&threads[i], NULL, spin, NULL);
+        uthread_set_tickets(threads[i], tickets[i]);
+    }
+
+    // main sleeps, so only the spinning threads compete
+    struct timespec run = { SECONDS, 0 };
+    nanosleep(&run, NULL);
+
+    unsigned long long runtime[3], total = 0;
+    for (int i = 0; i < 3; i++) {
+        runtime[i] = uthread_runtime_ns(threads[i]);
+        total += runtime[i];
+    }
+    stop = 1;
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%d s with stride scheduling\n", SECONDS);
+    for (int i = 0; i < 3; i++) {
+        printf("tickets %3u  runtime %6.0f ms  share %5.1f%%  (asked %u%%)\n", tickets[i],
+               runtime[i] / 1e6, 100.0 * runtime[i] / total, tickets[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Zero-copy transfers versus a read/write copy loop.
+//
+// forward: a producer thread writes FORWARD_BYTES into one socketpair, a
+//          forwarder moves them to a second socketpair, and a consumer
+//          reads them. The forwarder uses read/write through a CHUNK-byte
+//          buffer, then uthread_splice.
+// file:    a sender moves a FILE_BYTES memfd into a socketpair that a
+//          consumer reads. The sender uses read/write through a CHUNK-byte
+//          buffer, then uthread_sendfile.
+//
+// Reports GB/s from the first byte written to the last byte read. The
+// producer and consumer are the same in both variants, so the difference
+// is the copy the forwarder or sender saves.
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+int uthread_wait_fd(int fd, unsigned int events, int timeout_ms);
+int uthread_close(int fd);
+ssize_t uthread_splice(int fd_in, int fd_out, size_t len);
+ssize_t uthread_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+#define FORWARD_BYTES (1L << 30)
+#define FILE_BYTES (256L << 20)
+#define CHUNK (64 * 1024)
+
+struct Transfer {
+    int in;         // fd the thread reads from, or -1
+    int out;        // fd the thread writes to, or -1
+    long bytes;
+    bool zero_copy;
+};
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Thread stacks are small, so buffers come from the heap
+static char* buffer()
+{
+    char* buf = (char*)malloc(CHUNK);
+    memset(buf, 'x', CHUNK);
+    return buf;
+}
+
+static void write_all(int fd, const char* buf, long n)
+{
+    while (n > 0) {
+        ssize_t m = write(fd, buf, n);
+        if (m > 0) {
+            buf += m;
+            n -= m;
+        } else if (m == -1 && errno == EAGAIN) {
+            uthread_wait_fd(fd, EPOLLOUT, -1);
+        } else {
+            perror("write");
+            exit(1);
+        }
+    }
+}
+
+// Returns the bytes read, 0 at end of input
+static long read_some(int fd, char* buf)
+{
+    for (;;) {
+        ssize_t n = read(fd, buf, CHUNK);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno != EAGAIN) {
+            perror("read");
+            exit(1);
+        }
+        uthread_wait_fd(fd, EPOLLIN | EPOLLRDHUP, -1);
+    }
+}
+
+static void* producer(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    char* buf = buffer();
+    for (long left = t->bytes; left > 0; left -= CHUNK) {
+        write_all(t->out, buf, (left < CHUNK) ? left : CHUNK);
+    }
+    shutdown(t->out, SHUT_WR);
+    free(buf);
+    return NULL;
+}
+
+static void* forwarder(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    char* buf = buffer();
+    for (;;) {
+        long n = t->zero_copy ? uthread_splice(t->in, t->out, 1 << 20)
+                              : read_some(t->in, buf);
+        if (n <= 0) {
+            break;
+        }
+        if (!t->zero_copy) {
+            write_all(t->out, buf, n);
+        }
+    }
+    shutdown(t->out, SHUT_WR);
+    free(buf);
+    return NULL;
+}
+
+static void* consumer(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    char* buf = buffer();
+    long n;
+    while ((n = read_some(t->in, buf)) > 0) {
+        t->bytes += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void socket_pair(int fds[2])
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+}
+
+static void report(const char* name, long bytes, long received, double elapsed)
+{
+    printf("%-26s %7.2f GB/s  %s\n", name, bytes / elapsed / 1e9,
+           (received == bytes) ? "ok" : "SHORT");
+}
+
+static void run_forward(bool zero_copy)
+{
+    int first[2], second[2];
+    socket_pair(first);
+    socket_pair(second);
+    Transfer produce = { -1, first[0], FORWARD_BYTES, false };
+    Transfer forward = { first[1], second[0], 0, zero_copy };
+    Transfer consume = { second[1], -1, 0, false };
+
+    pthread_t threads[3];
+    double start = seconds();
+    pthread_create(&threads[0], NULL, consumer, &consume);
+    pthread_create(&threads[1], NULL, forwarder, &forward);
+    pthread_create(&threads[2], NULL, producer, &produce);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(zero_copy ? "forward uthread_splice" : "forward read/write", FORWARD_BYTES,
+           consume.bytes, seconds() - start);
+    uthread_close(first[0]);
+    uthread_close(first[1]);
+    uthread_close(second[0]);
+    uthread_close(second[1]);
+}
+
+static void* sender(void* arg)
+{
+    Transfer* t = (Transfer*)arg;
+    if (t->zero_copy) {
+        off_t offset = 0;
+        uthread_sendfile(t->out, t->in, &offset, t->bytes);
+    } else {
+        char* buf = buffer();
+        lseek(t->in, 0, SEEK_SET);
+        long n;
+        while ((n = read(t->in, buf, CHUNK)) > 0) {
+            write_all(t->out, buf, n);
+        }
+        free(buf);
+    }
+    shutdown(t->out, SHUT_WR);
+    return NULL;
+}
+
+static void run_file(int file, bool zero_copy)
+{
+    int sockets[2];
+    socket_pair(sockets);
+    Transfer send = { file, sockets[0], FILE_BYTES, zero_copy };
+    Transfer consume = { sockets[1], -1, 0, false };
+
+    pthread_t threads[2];
+    double start = seconds();
+    pthread_create(&threads[0], NULL, consumer, &consume);
+    pthread_create(&threads[1], NULL, sender, &send);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(zero_copy ? "file uthread_sendfile" : "file read/write", FILE_BYTES,
+           consume.bytes, seconds() - start);
+    uthread_close(sockets[0]);
+    uthread_close(sockets[1]);
+}
+
+int main()
+{
+    printf("forward %ld MB, file %ld MB, copy buffer %d KB\n", FORWARD_BYTES >> 20,
+           FILE_BYTES >> 20, CHUNK >> 10);
+    run_forward(false);
+    run_forward(true);
+
+    int file = memfd_create("splice_bench", 0);
+    char* buf = buffer();
+    for (long left = FILE_BYTES; left > 0; left -= CHUNK) {
+        if (write(file, buf, CHUNK) != CHUNK) {
+            perror("memfd write");
+            return 1;
+        }
+    }
+    free(buf);
+    run_file(file, false);
+    run_file(file, true);
+    close(file);
+    return 0;
+}
@@ -3,10 +3,22 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <semaphore.h>
 #include <errno.h>
 #include <string.h>       
+#include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #define JB_RBX   0
 #define JB_RBP   1
 #define JB_R12   2
@@ -18,11 +30,50 @@
 #define MAX_THREADS 150
 #define STACK_SIZE 32767
 #define TIMER_INTERVAL_MS 50
+// Signal used for preemption ticks; override with -DPREEMPT_SIGNAL=SIGRTMIN+n
+// if the application needs SIGALRM for itself
+#ifndef PREEMPT_SIGNAL
+#define PREEMPT_SIGNAL SIGALRM
+#endif
+// Clock that drives the tick and per-thread slice accounting. Build with
+// -DPREEMPT_CLOCK=CLOCK_THREAD_CPUTIME_ID to measure slices in consumed CPU
+// time, so time spent descheduled by the kernel or sleeping in a blocking
+// syscall is not charged to any thread.
+#ifndef PREEMPT_CLOCK
+#define PREEMPT_CLOCK CLOCK_MONOTONIC
+#endif
 #ifdef SEM_VALUE_MAX
 #undef SEM_VALUE_MAX
 #endif
 #define SEM_VALUE_MAX 65536
 #define MAX_SEMAPHORES 128
+// Marks a sem_t initialized with pshared != 0; its state lives in the sem_t
+#define SHARED_SEM_MAGIC 0x55534D31
+// Named semaphores live in shm objects under this prefix (distinct from glibc's)
+#define NAMED_SEM_PREFIX "/uthread-sem."
+#define NAMED_SEM_BUCKETS 64
+#define NAMED_SEM_INIT_TIMEOUT_NS 1000000000ULL   // wait for a concurrent creator
+#define MAX_RSEQ_REGIONS 32
+// Retires per thread between attempts to advance the reclamation epoch
+#define EBR_BATCH 64
+#define CACHE_LINE_SIZE 64
+// Buffers a thread keeps in its private cache of each buffer pool
+#define POOL_CACHE_SIZE 32
+// Stride scheduling: a thread's pass advances by STRIDE_ONE / tickets for
+// every slice it runs
+#define STRIDE_ONE (1ULL << 20)
+#define DEFAULT_TICKETS 100
+// Timer wheel: 4 levels of 64 slots with 1 ms ticks cover about 4.6 hours;
+// later timers wait in the top level and cascade down again
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_TICK_NS 1000000ULL
+// Readiness events taken from the epoll instance per epoll_wait call
+#define FD_EVENT_BATCH 64
+// x87 control word and MXCSR values the kernel hands to a fresh process
+#define DEFAULT_FPU_CW 0x037F
+#define DEFAULT_MXCSR 0x1F80
 enum ThreadStatus {
     READY,      
     RUNNING,    
@@ -36,9 +87,28 @@ struct SemaphoreData {
     int queue_size;            
     int queue_capacity;        
 };
+// Layout of a process-shared semaphore inside the caller's sem_t. Every field
+// is accessed atomically; value doubles as the futex word.
+struct SharedSemaphore {
+    unsigned int magic;
+    int value;
+    int waiters;                // green threads parked on it, across processes
+};
+static_assert(sizeof(SharedSemaphore) <= sizeof(sem_t),
+              "SharedSemaphore must fit inside sem_t");
+// Objects a thread retired during one epoch, freed two epochs later
+struct EbrLimbo {
+    void** ptrs;
+    void (**free_fns)(void*);
+    int count;
+    int capacity;
+    unsigned long epoch;
+};
+struct uthread_group;
 struct TCB {
     int thread_id;  
     void* stack;
+    void* stack_block;          // shared allocation when created by uthread_create_batch
     jmp_buf context;
     ThreadStatus status;
     void* (*start_routine)(void*);
@@ -46,6 +116,39 @@ struct TCB {
     void* return_value;         
     int joined_by;             
     bool has_been_joined;      
+    bool uses_fpu_state;        // thread changed rounding/exception control
+    unsigned short fpu_cw;
+    unsigned int mxcsr;
+    unsigned long long runtime_ns;  // time scheduled, measured on PREEMPT_CLOCK
+    SharedSemaphore* shared_wait;   // pshared semaphore this thread is parked on
+    int rcu_nesting;                // depth of uthread_rcu_read_lock sections
+    unsigned long rcu_quiescent;    // context_switches at the last quiescent state
+    int ebr_nesting;                // depth of uthread_ebr_enter regions
+    unsigned long ebr_epoch;        // global epoch seen at the last quiescent point
+    int ebr_retired;                // retires since the last advance attempt
+    EbrLimbo ebr_limbo[3];
+    int ec_next;                    // next thread parked on the same eventcount
+    bool daemon;                    // library worker; doesn't keep the process alive
+    int wait_fd;                    // fd this thread is parked on, or -1
+    unsigned int wait_events;       // events it is waiting for
+    unsigned int wait_revents;      // events that woke it (0 on timeout)
+    int fd_next;                    // next thread parked on the same fd
+    unsigned long long wait_deadline_ns;    // CLOCK_MONOTONIC, 0 for none
+    int splice_pipe[2];             // created on the first uthread_splice, else -1
+    unsigned long full_slices;      // preemptions after using a whole slice
+    unsigned long long hog_run_ns;  // run time since it last blocked or yielded
+    unsigned long hog_streak;       // that run time in whole slices
+    unsigned long hog_max_streak;
+    unsigned long hog_slice_flags;  // times the streak reached the hog limit
+    unsigned long long max_lock_ns; // longest tick delay blamed on this thread
+    unsigned long hog_lock_flags;   // delays over the lock limit
+    bool background;                // runs only when no other thread is ready
+    bool demoted;                   // moved to the background by the hog detector
+    unsigned int tickets;           // CPU share under stride scheduling
+    unsigned long long stride;
+    unsigned long long pass;        // virtual time; the lowest ready pass runs next
+    int heap_index;                 // position in stride_heap, or -1
+    uthread_group* group;           // CPU quota group, or NULL
 };
 static TCB tcb_array[MAX_THREADS];
 static int num_threads = 0;
@@ -54,10 +157,110 @@ static bool initialized = false;
 static SemaphoreData* semaphore_map[MAX_SEMAPHORES];
 static sem_t* semaphore_keys[MAX_SEMAPHORES];
 static int num_semaphores = 0;
+static int num_shared_waiters = 0;
+
+// Scheduling policy. Under stride scheduling the ready threads are kept in
+// a min-heap ordered by pass.
+enum uthread_sched_policy {
+    UTHREAD_SCHED_ROUND_ROBIN,
+    UTHREAD_SCHED_STRIDE
+};
+static int sched_policy = UTHREAD_SCHED_ROUND_ROBIN;
+static int stride_heap[MAX_THREADS];
+static int stride_heap_size = 0;
+static unsigned long long stride_global_pass = 0;   // pass of the last thread picked
+
+// Thread groups with CPU quotas. A thread is throttled while any group it
+// belongs to, directly or through a parent, has used up its quota.
+static uthread_group* group_list = NULL;    // every group, newest first
+static int num_throttled_groups = 0;
+
+// Reactor: one edge-triggered epoll instance shared by all threads. Each fd
+// is registered once for every event; edges the kernel reports while nobody
+// waits are cached as ready bits, so a later uthread_wait_fd returns at once.
+struct FdState {
+    bool registered;
+    unsigned int ready;         // events seen since the last wait consumed them
+    int waiters;                // parked threads, linked through TCB::fd_next
+};
+static int epoll_fd = -1;
+static FdState* fd_table = NULL;
+static int fd_table_size = 0;
+static int num_fd_waiters = 0;
+
+// Threads blocked with a deadline (sleeping, or waiting on an fd with a
+// timeout). In virtual time mode the clock only moves when every thread is
+// blocked, jumping straight to the nearest deadline.
+static int num_timed_waiters = 0;
+static bool virtual_time = false;
+static unsigned long long virtual_now_ns = 0;
+
+// Callback timer wheel, advanced by a daemon timer thread
+struct uthread_timer;
+static uthread_timer* timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static int timer_wheel_count[TIMER_WHEEL_LEVELS];
+static unsigned long long timer_wheel_tick;     // next tick to process
+static int timer_thread = -1;           // -2 while it is being created
+static bool timer_thread_parked = false;
+
+// Process-local cache of mapped named semaphores, hashed by name so repeated
+// sem_open of the same name returns the existing mapping without syscalls
+struct NamedSemaphore {
+    char* name;
+    sem_t* sem;
+    int refs;
+    bool linked;                // still reachable by name (not sem_unlink'ed)
+    NamedSemaphore* next;
+};
+static NamedSemaphore* named_semaphores[NAMED_SEM_BUCKETS];
+static NamedSemaphore* unlinked_named_semaphores = NULL;
+
+// Incremented on every pass through schedule(); drives RCU grace periods
+static unsigned long context_switches = 0;
+struct RcuCallback {
+    void (*func)(void*);
+    void* arg;
+    RcuCallback* next;
+};
+static RcuCallback* rcu_pending = NULL;     // queued since the current grace period began
+static RcuCallback* rcu_waiting = NULL;     // waiting for the grace period below to end
+static unsigned long rcu_waiting_since = 0;
+
+// Restartable code regions: a thread preempted with its PC in [start, end)
+// resumes at abort_ip instead
+struct RseqRegion {
+    unsigned long start;
+    unsigned long end;
+    unsigned long abort_ip;
+};
+static RseqRegion rseq_regions[MAX_RSEQ_REGIONS];
+static int num_rseq_regions = 0;
+
+static unsigned long ebr_global_epoch = 0;
+
+// Initial register frame shared by all new threads, built once in init_threading
+static jmp_buf context_template;
+static long int mangled_wrapper_pc;
 
 // Save original state to restore during cleanup
 static struct sigaction original_sigaction;
 static sigset_t original_sigmask;
+static timer_t preempt_timer;
+static unsigned long long slice_start_ns;
+// When the next tick is due on PREEMPT_CLOCK (0 while ticks are off). A tick
+// handled late means preemption was blocked, normally by lock().
+static unsigned long long next_tick_ns = 0;
+
+// Hog detector: set by uthread_hog_configure; limits of 0 disable a check
+enum uthread_hog_reason {
+    UTHREAD_HOG_SLICES,         // ran too many consecutive full slices
+    UTHREAD_HOG_LOCK            // kept preemption disabled too long
+};
+static unsigned long hog_slice_limit = 0;
+static unsigned long long hog_lock_limit_ns = 0;
+static void (*hog_callback)(pthread_t thread, int reason, unsigned long long amount) = NULL;
+static bool hog_demote = false;
+static bool involuntary_switch = false;     // set by the tick handler for schedule()
 static long int i64_ptr_mangle(long int p)
 {
     long int ret;
@@ -72,9 +275,46 @@ static long int i64_ptr_mangle(long int p)
     return ret;
 }
 static void schedule();
-static void signal_handler(int signo);
+static void signal_handler(int signo, siginfo_t* info, void* ucontext);
 static void thread_wrapper();
 static void cleanup_all_resources();
+static void init_threading();
+static void save_fpu_state(TCB* tcb)
+{
+    unsigned short cw;
+    unsigned int mxcsr;
+    asm volatile("fnstcw %0" : "=m"(cw));
+    asm volatile("stmxcsr %0" : "=m"(mxcsr));
+#ifndef UTHREAD_FPU_EAGER
+    // Lazy mode: only track threads that ever leave the default control state
+    if (!tcb->uses_fpu_state && cw == DEFAULT_FPU_CW && mxcsr == DEFAULT_MXCSR) {
+        return;
+    }
+#endif
+    tcb->uses_fpu_state = true;
+    tcb->fpu_cw = cw;
+    tcb->mxcsr = mxcsr;
+}
+static void restore_fpu_state(TCB* tcb)
+{
+    unsigned short cw = DEFAULT_FPU_CW;
+    unsigned int mxcsr = DEFAULT_MXCSR;
+    if (tcb->uses_fpu_state) {
+        cw = tcb->fpu_cw;
+        mxcsr = tcb->mxcsr;
+    }
+    unsigned short cur_cw;
+    unsigned int cur_mxcsr;
+    asm volatile("fnstcw %0" : "=m"(cur_cw));
+    asm volatile("stmxcsr %0" : "=m"(cur_mxcsr));
+    // Loading control registers is far more expensive than reading them
+    if (cur_cw != cw) {
+        asm volatile("fldcw %0" : : "m"(cw));
+    }
+    if (cur_mxcsr != mxcsr) {
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+    }
+}
 static SemaphoreData* get_semaphore_data(sem_t *sem)
 {
     for (int i = 0; i < num_semaphores; i++) {
@@ -107,458 +347,4061 @@ static void remove_semaphore_mapping(sem_t *sem)
         }
     }
 }
-static void thread_wrapper()
+static SharedSemaphore* get_shared_semaphore(sem_t *sem)
 {
-    sigset_t set;
-    sigemptyset(&set);
-    sigprocmask(SIG_SETMASK, &set, NULL);
-    TCB* current_tcb = &tcb_array[current_thread];
-    void* result = current_tcb->start_routine(current_tcb->arg);
-    pthread_exit(result);  
+    SharedSemaphore* shared = (SharedSemaphore*)sem;
+    if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != SHARED_SEM_MAGIC) {
+        return NULL;
+    }
+    return shared;
 }
-static void schedule()
+static bool shared_sem_trywait(SharedSemaphore* shared)
 {
-    int original_thread = current_thread;
-    int checked_count = 0;
-    while (checked_count < num_threads) {
-        current_thread = (current_thread + 1) % num_threads;
-        checked_count++;
-        if (tcb_array[current_thread].status == READY) {
-            tcb_array[current_thread].status = RUNNING;
-            return;
+    int value = __atomic_load_n(&shared->value, __ATOMIC_RELAXED);
+    while (value > 0) {
+        if (__atomic_compare_exchange_n(&shared->value, &value, value - 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
         }
     }
-    bool all_exited = true;
-    for (int i = 0; i < num_threads; i++) {
-        if (tcb_array[i].status != EXITED) {
-            all_exited = false;
+    return false;
+}
+static long futex(int* addr, int op, int val, const struct timespec* timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+static bool stride_before(int a, int b)
+{
+    return tcb_array[a].pass < tcb_array[b].pass ||
+           (tcb_array[a].pass == tcb_array[b].pass && a < b);
+}
+static void stride_heap_place(int index, int t)
+{
+    stride_heap[index] = t;
+    tcb_array[t].heap_index = index;
+}
+static void stride_heap_sift_up(int index)
+{
+    int t = stride_heap[index];
+    while (index > 0 && stride_before(t, stride_heap[(index - 1) / 2])) {
+        stride_heap_place(index, stride_heap[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    stride_heap_place(index, t);
+}
+static void stride_heap_sift_down(int index)
+{
+    int t = stride_heap[index];
+    for (;;) {
+        int child = 2 * index + 1;
+        if (child >= stride_heap_size) {
             break;
         }
+        if (child + 1 < stride_heap_size &&
+            stride_before(stride_heap[child + 1], stride_heap[child])) {
+            child++;
+        }
+        if (!stride_before(stride_heap[child], t)) {
+            break;
+        }
+        stride_heap_place(index, stride_heap[child]);
+        index = child;
     }
-    if (all_exited) {
-        cleanup_all_resources();
-        exit(0);
-    }
-    current_thread = original_thread;
-    if (tcb_array[current_thread].status != EXITED &&
-        tcb_array[current_thread].status != BLOCKED) {
-        tcb_array[current_thread].status = RUNNING;
+    stride_heap_place(index, t);
+}
+static void stride_heap_push(int t)
+{
+    stride_heap_place(stride_heap_size++, t);
+    stride_heap_sift_up(stride_heap_size - 1);
+}
+static void stride_heap_remove(int t)
+{
+    int index = tcb_array[t].heap_index;
+    tcb_array[t].heap_index = -1;
+    int last = stride_heap[--stride_heap_size];
+    if (index == stride_heap_size) {
+        return;
     }
+    stride_heap_place(index, last);
+    stride_heap_sift_up(index);
+    stride_heap_sift_down(tcb_array[last].heap_index);
 }
-static void signal_handler(int signo)
+// Mark a blocked or new thread runnable. Under stride scheduling it joins
+// the heap no earlier than the current virtual time, so a long sleep
+// doesn't bank CPU to monopolize later.
+static bool thread_throttled(int t);
+static void make_ready(int t)
 {
-    (void)signo;  
-    sigset_t oldset, newset;
-    sigemptyset(&newset);
-    sigaddset(&newset, SIGALRM);
-    sigprocmask(SIG_BLOCK, &newset, &oldset);
-    int old_thread = current_thread;
-    if (setjmp(tcb_array[old_thread].context) == 0) {
-        if (tcb_array[old_thread].status == RUNNING) {
-            tcb_array[old_thread].status = READY;
+    tcb_array[t].status = READY;
+    if (sched_policy == UTHREAD_SCHED_STRIDE && tcb_array[t].heap_index == -1 &&
+        !thread_throttled(t)) {
+        if (tcb_array[t].pass < stride_global_pass) {
+            tcb_array[t].pass = stride_global_pass;
         }
-        schedule();
-        sigprocmask(SIG_SETMASK, &oldset, NULL);
-        longjmp(tcb_array[current_thread].context, 1);
+        stride_heap_push(t);
     }
-    sigprocmask(SIG_SETMASK, &oldset, NULL);
 }
-static void cleanup_all_resources()
+// Lowest-pass ready thread, preferring the foreground class; -1 if none
+static int stride_pick()
 {
-    // Prevent double-cleanup if called both explicitly and via atexit()
-    if (!initialized) {
-        return;
+    if (stride_heap_size == 0) {
+        return -1;
     }
-
-    // Block SIGALRM first to prevent any signals during cleanup
-    sigset_t signal_set, old_set;
-    sigemptyset(&signal_set);
-    sigaddset(&signal_set, SIGALRM);
-    sigprocmask(SIG_BLOCK, &signal_set, &old_set);
-
-    // Disable the timer
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = 0;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = 0;
-    setitimer(ITIMER_REAL, &timer, NULL);
-
-    // Free all thread stacks and clean up TCB entries
-    // Only clean up threads that have been joined OR never started
-    // Zombie threads (exited but not joined) should also be cleaned up at program exit
-    int threads_to_clean = num_threads;
-    for (int i = 0; i < threads_to_clean; i++) {
-        // Free stack for all threads except current (thread 0's stack is NULL anyway)
-        // At program exit, we need to free ALL allocated stacks, including zombies
-        if (i != current_thread && tcb_array[i].stack != NULL) {
-            free(tcb_array[i].stack);
-            tcb_array[i].stack = NULL;
+    int best = stride_heap[0];
+    if (tcb_array[best].background || tcb_array[best].demoted) {
+        for (int i = 1; i < stride_heap_size; i++) {
+            int t = stride_heap[i];
+            if (!tcb_array[t].background && !tcb_array[t].demoted &&
+                (tcb_array[best].background || tcb_array[best].demoted ||
+                 stride_before(t, best))) {
+                best = t;
+            }
         }
-
-        // Clean up TCB entry completely - reset ALL fields to clean state
-        tcb_array[i].thread_id = 0;
-        tcb_array[i].status = EXITED;
-        tcb_array[i].has_been_joined = true;
-        tcb_array[i].return_value = NULL;
-        tcb_array[i].joined_by = -1;
-        tcb_array[i].start_routine = NULL;
-        tcb_array[i].arg = NULL;
-        // Clear the context (saved registers) - zero it out
-        memset(&tcb_array[i].context, 0, sizeof(jmp_buf));
     }
-
-    // Free all semaphore data structures
-    // Only clean up semaphores that are still allocated (up to num_semaphores)
-    // Going through all MAX_SEMAPHORES could access uninitialized/garbage pointers
-    int sems_to_clean = num_semaphores;
-    for (int i = 0; i < sems_to_clean; i++) {
-        if (semaphore_map[i] != NULL) {
-            // Mark as uninitialized before freeing
-            semaphore_map[i]->initialized = false;
-            semaphore_map[i]->value = 0;
-            semaphore_map[i]->queue_size = 0;
-
-            if (semaphore_map[i]->waiting_queue != NULL) {
-                free(semaphore_map[i]->waiting_queue);
-                semaphore_map[i]->waiting_queue = NULL;
-            }
-            free(semaphore_map[i]);
-            semaphore_map[i] = NULL;
+    stride_heap_remove(best);
+    return best;
+}
+struct uthread_group {
+    uthread_group* parent;
+    uthread_group* next;                // in group_list
+    int num_children;
+    int num_threads;                    // live threads attached directly
+    unsigned long long quota_ns;        // CPU time allowed per period, 0 for no cap
+    unsigned long long period_ns;
+    unsigned long long period_start_ns; // on clock_now_ns()
+    unsigned long long period_usage_ns; // may exceed the quota by one overrun
+    bool throttled;
+    unsigned long long throttled_since_ns;
+    unsigned long long usage_ns;        // including subgroups
+    unsigned long long periods;
+    unsigned long long times_throttled;
+    unsigned long long throttled_ns;
+};
+static bool thread_throttled(int t)
+{
+    for (uthread_group* group = tcb_array[t].group;
+         group != NULL && num_throttled_groups > 0; group = group->parent) {
+        if (group->throttled) {
+            return true;
         }
-        semaphore_keys[i] = NULL;
     }
-
-    // Clear remaining keys
-    for (int i = sems_to_clean; i < MAX_SEMAPHORES; i++) {
-        semaphore_keys[i] = NULL;
+    return false;
+}
+static bool group_contains(uthread_group* group, int t)
+{
+    for (uthread_group* g = tcb_array[t].group; g != NULL; g = g->parent) {
+        if (g == group) {
+            return true;
+        }
     }
-
-    // Reset semaphore counter
-    num_semaphores = 0;
-
-    // Reset threading system state
-    num_threads = 0;
-    current_thread = 0;
-    initialized = false;
-
-    // Restore the original SIGALRM handler (as it was before init_threading)
-    sigaction(SIGALRM, &original_sigaction, NULL);
-
-    // Restore the original signal mask (as it was before init_threading)
-    sigprocmask(SIG_SETMASK, &original_sigmask, NULL);
+    return false;
 }
-static void init_threading()
+// Bring a ready thread's place in the stride heap in line with whether it
+// is throttled. Round robin checks throttling as it scans instead.
+static void group_requeue(int t)
 {
-    if (initialized) {
+    if (tcb_array[t].status != READY) {
         return;
     }
-    initialized = true;
-
-    // Initialize all TCB entries to a clean state
-    for (int i = 0; i < MAX_THREADS; i++) {
-        tcb_array[i].thread_id = i;
-        tcb_array[i].stack = NULL;
-        tcb_array[i].status = EXITED;
-        tcb_array[i].start_routine = NULL;
-        tcb_array[i].arg = NULL;
-        tcb_array[i].return_value = NULL;
-        tcb_array[i].joined_by = -1;
-        tcb_array[i].has_been_joined = (i > 0); // All except thread 0 start as "joined"
+    if (tcb_array[t].heap_index != -1 && thread_throttled(t)) {
+        stride_heap_remove(t);
+    } else {
+        make_ready(t);
     }
-
-    // Set up the main thread (thread 0)
-    tcb_array[0].status = RUNNING;
-    tcb_array[0].has_been_joined = false;
-    num_threads = 1;
-    current_thread = 0;
-
-    // Save the original signal handler and mask FIRST, before any modifications
-    sigaction(SIGALRM, NULL, &original_sigaction);
-    sigprocmask(SIG_SETMASK, NULL, &original_sigmask);
-
-    // Register cleanup function to be called at program exit
-    atexit(cleanup_all_resources);
-
-    // Install our custom signal handler
-    struct sigaction sa;
-    sa.sa_handler = signal_handler;
-    sa.sa_flags = SA_NODEFER;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGALRM, &sa, NULL);
-    struct itimerval timer;
-    timer.it_value.tv_sec = 0;
-    timer.it_value.tv_usec = TIMER_INTERVAL_MS * 1000;
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = TIMER_INTERVAL_MS * 1000;
-    setitimer(ITIMER_REAL, &timer, NULL);
 }
-void lock()
+static unsigned long long clock_now_ns();
+static void preempt_by(unsigned long long deadline);
+static void group_set_throttled(uthread_group* group, bool throttled,
+                                unsigned long long now)
 {
-    sigset_t signal_set;
-    sigemptyset(&signal_set);           
-    sigaddset(&signal_set, SIGALRM);    
-    sigprocmask(SIG_BLOCK, &signal_set, NULL);  
+    group->throttled = throttled;
+    if (throttled) {
+        num_throttled_groups++;
+        group->times_throttled++;
+        group->throttled_since_ns = now;
+        // Release the group on time even if another thread keeps the CPU
+        preempt_by(group->period_start_ns + group->period_ns);
+    } else {
+        num_throttled_groups--;
+        group->throttled_ns += now - group->throttled_since_ns;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (group_contains(group, i)) {
+            group_requeue(i);
+        }
+    }
 }
-void unlock()
+// Start new periods once the current one has ended. Time used beyond the
+// quota is carried over, so an overrun is paid back from the next period.
+static void group_refresh(uthread_group* group, unsigned long long now)
 {
-    sigset_t signal_set;
-    sigemptyset(&signal_set);           
-    sigaddset(&signal_set, SIGALRM);    
-    sigprocmask(SIG_UNBLOCK, &signal_set, NULL);  
+    if (group->quota_ns == 0 || now < group->period_start_ns + group->period_ns) {
+        return;
+    }
+    unsigned long long elapsed = (now - group->period_start_ns) / group->period_ns;
+    unsigned long long allowance = elapsed * group->quota_ns;
+    group->periods += elapsed;
+    group->period_start_ns += elapsed * group->period_ns;
+    group->period_usage_ns = (group->period_usage_ns > allowance)
+                             ? group->period_usage_ns - allowance : 0;
+    if (group->throttled && group->period_usage_ns < group->quota_ns) {
+        group_set_throttled(group, false, now);
+    }
 }
-int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
-                   void *(*start_routine)(void*), void *arg)
+static void refresh_throttled_groups()
 {
-    (void)attr;
-    if (!initialized) {
-        init_threading();
+    unsigned long long now = clock_now_ns();
+    for (uthread_group* group = group_list;
+         group != NULL && num_throttled_groups > 0; group = group->next) {
+        if (group->throttled) {
+            group_refresh(group, now);
+        }
     }
-
-    lock();
-
-    // Never reuse thread IDs - simpler and cleaner
-    // Each thread gets a unique ID from 0 to MAX_THREADS-1
-    if (num_threads >= MAX_THREADS) {
-        unlock();
-        return -1;
+}
+// Charge CPU time to a thread's groups, throttling any that have used up
+// their quota. An exited thread leaves its group once charged.
+static void group_charge(int t, unsigned long long ran)
+{
+    unsigned long long now = clock_now_ns();
+    for (uthread_group* group = tcb_array[t].group; group != NULL; group = group->parent) {
+        group_refresh(group, now);
+        group->usage_ns += ran;
+        if (group->quota_ns == 0) {
+            continue;
+        }
+        group->period_usage_ns += ran;
+        if (!group->throttled && group->period_usage_ns >= group->quota_ns) {
+            group_set_throttled(group, true, now);
+        }
     }
-
-    int new_thread_id = num_threads;
-    num_threads++;
-
-    TCB* new_tcb = &tcb_array[new_thread_id];
-    new_tcb->thread_id = new_thread_id;
-    new_tcb->status = READY;
-    new_tcb->start_routine = start_routine;
-    new_tcb->arg = arg;
-    new_tcb->return_value = NULL;
-    new_tcb->joined_by = -1;
-    new_tcb->has_been_joined = false;
-
-    // Allocate stack for the new thread
-    new_tcb->stack = malloc(STACK_SIZE);
-    if (new_tcb->stack == NULL) {
-        num_threads--;
-        unlock();
-        return -1;
+    if (tcb_array[t].status == EXITED) {
+        tcb_array[t].group->num_threads--;
+        tcb_array[t].group = NULL;
     }
-    setjmp(new_tcb->context);
-    void* stack_top = (void*)((char*)new_tcb->stack + STACK_SIZE);
-    unsigned long stack_addr = (unsigned long)stack_top;
-    stack_addr = stack_addr - (stack_addr % 16);
-    stack_addr -= 8;
-    long int mangled_sp = i64_ptr_mangle((long int)stack_addr);
-    ((long int*)new_tcb->context)[JB_RSP] = mangled_sp;
-    ((long int*)new_tcb->context)[JB_RBP] = mangled_sp;
-    long int mangled_pc = i64_ptr_mangle((long int)thread_wrapper);
-    ((long int*)new_tcb->context)[JB_PC] = mangled_pc;
-    *thread = (pthread_t)(long)new_thread_id;
-    unlock();  
-    return 0;
 }
-void pthread_exit(void *value_ptr)
+// Cut the next slice short if the thread's groups have less quota left
+// than that, so a capped group stops on time rather than at the next tick.
+// The slice is also limited to the thread's fair part of each quota, or
+// whichever member ran first after a release would use up all of it.
+static void group_limit_slice(int t)
 {
-    lock();  
-    tcb_array[current_thread].return_value = value_ptr;
-    tcb_array[current_thread].status = EXITED;
-    int joined_by = tcb_array[current_thread].joined_by;
-    if (joined_by != -1) {
-        tcb_array[joined_by].status = READY;
+    if (tcb_array[t].group == NULL) {
+        return;
     }
-    bool all_exited = true;
-    for (int i = 0; i < num_threads; i++) {
-        if (tcb_array[i].status != EXITED) {
-            all_exited = false;
-            break;
+    unsigned long long now = clock_now_ns();
+    unsigned long long left = 0;
+    bool capped = false;
+    for (uthread_group* group = tcb_array[t].group; group != NULL; group = group->parent) {
+        if (group->quota_ns == 0) {
+            continue;
+        }
+        group_refresh(group, now);
+        unsigned long long remaining = (group->period_usage_ns < group->quota_ns)
+                                       ? group->quota_ns - group->period_usage_ns : 0;
+        unsigned long long members = 1;
+        for (int i = 0; i < num_threads; i++) {
+            if (i != t && tcb_array[i].status == READY && group_contains(group, i)) {
+                members++;
+            }
+        }
+        if (remaining > group->quota_ns / members) {
+            remaining = group->quota_ns / members;
+        }
+        if (!capped || remaining < left) {
+            left = remaining;
+            capped = true;
         }
     }
-    if (all_exited) {
-        cleanup_all_resources();
-        exit(0);
-    }
-    schedule();
-    unlock();  
-    longjmp(tcb_array[current_thread].context, 1);
+    if (capped) {
+        preempt_by(now + left);
+    }
 }
-pthread_t pthread_self(void)
+// End of the current period of the throttled group released first, or 0
+static unsigned long long next_unthrottle_ns()
 {
-    return (pthread_t)(long)tcb_array[current_thread].thread_id;
+    unsigned long long nearest = 0;
+    for (uthread_group* group = group_list;
+         group != NULL && num_throttled_groups > 0; group = group->next) {
+        unsigned long long end = group->period_start_ns + group->period_ns;
+        if (group->throttled && (nearest == 0 || end < nearest)) {
+            nearest = end;
+        }
+    }
+    return nearest;
 }
-int pthread_join(pthread_t thread, void **value_ptr)
+// Hand pshared semaphore units to locally parked threads. Called by the
+// scheduler, which acts as this process's single waiter on the futexes.
+// Returns true if any parked thread got its unit and was made ready
+static bool poll_shared_waiters()
 {
-    lock();  
-    int target_index = -1;
-    for (int i = 0; i < num_threads; i++) {
-        if (tcb_array[i].thread_id == (int)(long)thread) {
-            target_index = i;
-            break;
+    bool woke = false;
+    for (int i = 0; i < num_threads && num_shared_waiters > 0; i++) {
+        SharedSemaphore* shared = tcb_array[i].shared_wait;
+        if (shared != NULL && shared_sem_trywait(shared)) {
+            __atomic_fetch_sub(&shared->waiters, 1, __ATOMIC_RELAXED);
+            tcb_array[i].shared_wait = NULL;
+            make_ready(i);
+            num_shared_waiters--;
+            woke = true;
         }
     }
-    if (target_index == -1) {
-        unlock();
-        return ESRCH;  
+    return woke;
+}
+static void free_thread_stack(TCB* tcb)
+{
+    if (tcb->stack_block != NULL) {
+        // Batch-created stacks share one allocation; the first word is its refcount
+        int* refs = (int*)tcb->stack_block;
+        if (--(*refs) == 0) {
+            free(tcb->stack_block);
+        }
+        tcb->stack_block = NULL;
+    } else if (tcb->stack != NULL) {
+        free(tcb->stack);
     }
-    if (tcb_array[target_index].has_been_joined) {
-        unlock();
-        return EINVAL;
+    tcb->stack = NULL;
+}
+static void close_splice_pipe(TCB* tcb)
+{
+    if (tcb->splice_pipe[0] != -1) {
+        close(tcb->splice_pipe[0]);
+        close(tcb->splice_pipe[1]);
+        tcb->splice_pipe[0] = -1;
+        tcb->splice_pipe[1] = -1;
     }
-    if (target_index == current_thread) {
-        unlock();
-        return EDEADLK;
+}
+static void init_thread_context(TCB* tcb)
+{
+    memcpy(tcb->context, context_template, sizeof(jmp_buf));
+    void* stack_top = (void*)((char*)tcb->stack + STACK_SIZE);
+    unsigned long stack_addr = (unsigned long)stack_top;
+    stack_addr = stack_addr - (stack_addr % 16);
+    stack_addr -= 8;
+    long int mangled_sp = i64_ptr_mangle((long int)stack_addr);
+    ((long int*)tcb->context)[JB_RSP] = mangled_sp;
+    ((long int*)tcb->context)[JB_RBP] = mangled_sp;
+    ((long int*)tcb->context)[JB_PC] = mangled_wrapper_pc;
+    tcb->runtime_ns = 0;
+    tcb->shared_wait = NULL;
+    tcb->rcu_nesting = 0;
+    tcb->rcu_quiescent = context_switches;
+    tcb->ebr_nesting = 0;
+    tcb->ebr_epoch = ebr_global_epoch;
+    tcb->ebr_retired = 0;
+    tcb->daemon = false;
+    tcb->wait_fd = -1;
+    tcb->wait_deadline_ns = 0;
+    tcb->splice_pipe[0] = -1;
+    tcb->splice_pipe[1] = -1;
+    tcb->full_slices = 0;
+    tcb->hog_run_ns = 0;
+    tcb->hog_streak = 0;
+    tcb->hog_max_streak = 0;
+    tcb->hog_slice_flags = 0;
+    tcb->max_lock_ns = 0;
+    tcb->hog_lock_flags = 0;
+    tcb->background = false;
+    tcb->demoted = false;
+    tcb->tickets = DEFAULT_TICKETS;
+    tcb->stride = STRIDE_ONE / DEFAULT_TICKETS;
+    tcb->pass = stride_global_pass;
+    tcb->heap_index = -1;
+    // Like the floating-point environment, the group is inherited
+    tcb->group = tcb_array[current_thread].group;
+    if (tcb->group != NULL) {
+        tcb->group->num_threads++;
     }
-    if (tcb_array[target_index].status == EXITED) {
-        if (value_ptr != NULL) {
-            *value_ptr = tcb_array[target_index].return_value;
+    // New threads inherit the creator's floating-point environment
+    tcb->uses_fpu_state = false;
+    save_fpu_state(tcb);
+}
+static unsigned long long preempt_clock_ns()
+{
+    struct timespec ts;
+    clock_gettime(PREEMPT_CLOCK, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+// Charge the time since the last switch to the outgoing thread
+static unsigned long long account_slice()
+{
+    unsigned long long now = preempt_clock_ns();
+    unsigned long long ran = now - slice_start_ns;
+    tcb_array[current_thread].runtime_ns += ran;
+    slice_start_ns = now;
+    return ran;
+}
+// Time used for every deadline: CLOCK_MONOTONIC, or the virtual clock
+static unsigned long long clock_now_ns()
+{
+    return virtual_time ? virtual_now_ns : monotonic_ns();
+}
+// Bring the next preemption tick forward to a deadline that falls before
+// it, so a sleeper is released on time even while another thread is busy
+// computing rather than up to a full slice late
+static void preempt_by(unsigned long long deadline)
+{
+    if (virtual_time || PREEMPT_CLOCK != CLOCK_MONOTONIC) {
+        return;
+    }
+    struct itimerspec timer;
+    timer_gettime(preempt_timer, &timer);
+    unsigned long long now = monotonic_ns();
+    unsigned long long until = (deadline > now) ? deadline - now : 1;
+    unsigned long long next_tick = (unsigned long long)timer.it_value.tv_sec * 1000000000ULL +
+                                   timer.it_value.tv_nsec;
+    if (next_tick != 0 && until >= next_tick) {
+        return;
+    }
+    timer.it_value.tv_sec = until / 1000000000ULL;
+    timer.it_value.tv_nsec = until % 1000000000ULL;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_nsec = TIMER_INTERVAL_MS * 1000000L;
+    timer_settime(preempt_timer, 0, &timer, NULL);
+    next_tick_ns = now + until;
+}
+// Move next_tick_ns past now. Ticks that expired while the signal was
+// blocked arrive as one, and are not late by the time spent blocked.
+static void skip_missed_ticks(unsigned long long now)
+{
+    if (next_tick_ns != 0) {
+        unsigned long long interval = TIMER_INTERVAL_MS * 1000000ULL;
+        while (next_tick_ns <= now) {
+            next_tick_ns += interval;
         }
-        // Clean up the zombie thread's resources completely
-        if (tcb_array[target_index].stack != NULL) {
-            free(tcb_array[target_index].stack);
-            tcb_array[target_index].stack = NULL;
+    }
+}
+static void set_deadline(int t, unsigned long long deadline)
+{
+    tcb_array[t].wait_deadline_ns = deadline;
+    if (deadline != 0) {
+        num_timed_waiters++;
+        preempt_by(deadline);
+    }
+}
+static void clear_deadline(int t)
+{
+    if (tcb_array[t].wait_deadline_ns != 0) {
+        tcb_array[t].wait_deadline_ns = 0;
+        num_timed_waiters--;
+    }
+}
+// Wake a thread parked in uthread_wait_fd, unlinking it from its fd
+static void wake_fd_waiter(int t, unsigned int revents)
+{
+    FdState* state = &fd_table[tcb_array[t].wait_fd];
+    int* link = &state->waiters;
+    while (*link != t) {
+        link = &tcb_array[*link].fd_next;
+    }
+    *link = tcb_array[t].fd_next;
+    tcb_array[t].wait_fd = -1;
+    tcb_array[t].wait_revents = revents;
+    clear_deadline(t);
+    make_ready(t);
+    num_fd_waiters--;
+}
+// Harvest a batch of readiness events, waking every waiter interested in
+// them. Returns the number of events harvested.
+static int poll_fd_events(int timeout_ms)
+{
+    struct epoll_event events[FD_EVENT_BATCH];
+    int n = epoll_wait(epoll_fd, events, FD_EVENT_BATCH, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd >= fd_table_size || !fd_table[fd].registered) {
+            continue;
         }
-        // Clear ALL TCB fields to show thread is fully cleaned up
-        tcb_array[target_index].thread_id = 0;
-        tcb_array[target_index].status = EXITED;
-        tcb_array[target_index].has_been_joined = true;
-        tcb_array[target_index].return_value = NULL;
-        tcb_array[target_index].joined_by = -1;
-        tcb_array[target_index].start_routine = NULL;
-        tcb_array[target_index].arg = NULL;
-        memset(&tcb_array[target_index].context, 0, sizeof(jmp_buf));
-        unlock();
-        return 0;
+        FdState* state = &fd_table[fd];
+        unsigned int revents = events[i].events;
+        unsigned int consumed = 0;
+        int t = state->waiters;
+        while (t != -1) {
+            int next = tcb_array[t].fd_next;
+            // Errors and hangups are reported whether or not they were asked for
+            unsigned int mask = tcb_array[t].wait_events | EPOLLERR | EPOLLHUP;
+            if (revents & mask) {
+                consumed |= revents & tcb_array[t].wait_events;
+                wake_fd_waiter(t, revents & mask);
+            }
+            t = next;
+        }
+        state->ready |= revents & ~consumed;
     }
-    tcb_array[target_index].joined_by = current_thread;
-    tcb_array[current_thread].status = BLOCKED;
-    int old_thread = current_thread;
-    if (setjmp(tcb_array[old_thread].context) == 0) {
-        schedule();
-        unlock();
-        longjmp(tcb_array[current_thread].context, 1);
+    return (n > 0) ? n : 0;
+}
+// Wake every thread whose deadline has passed
+static void expire_timed_waiters()
+{
+    unsigned long long now = clock_now_ns();
+    unsigned long long nearest = 0;
+    bool woke = false;
+    for (int i = 0; i < num_threads && num_timed_waiters > 0; i++) {
+        unsigned long long deadline = tcb_array[i].wait_deadline_ns;
+        if (deadline == 0) {
+            continue;
+        }
+        if (deadline > now) {
+            if (nearest == 0 || deadline < nearest) {
+                nearest = deadline;
+            }
+            continue;
+        }
+        if (tcb_array[i].wait_fd != -1) {
+            wake_fd_waiter(i, 0);
+        } else {
+            clear_deadline(i);
+            make_ready(i);
+        }
+        woke = true;
     }
-    lock();
-    if (value_ptr != NULL) {
-        *value_ptr = tcb_array[target_index].return_value;
+    // The tick may have been brought forward for the deadlines just
+    // handled; aim the next one at whoever is due next
+    if (woke && nearest != 0) {
+        preempt_by(nearest);
     }
-    // Clean up the zombie thread's resources completely
-    if (tcb_array[target_index].stack != NULL) {
-        free(tcb_array[target_index].stack);
-        tcb_array[target_index].stack = NULL;
+}
+// Nearest deadline of any blocked or throttled thread, or 0 if there is none
+static unsigned long long next_deadline_ns()
+{
+    unsigned long long nearest = 0;
+    for (int i = 0; i < num_threads && num_timed_waiters > 0; i++) {
+        unsigned long long deadline = tcb_array[i].wait_deadline_ns;
+        if (deadline != 0 && (nearest == 0 || deadline < nearest)) {
+            nearest = deadline;
+        }
     }
-    // Clear ALL TCB fields to show thread is fully cleaned up
-    tcb_array[target_index].thread_id = 0;
-    tcb_array[target_index].status = EXITED;
-    tcb_array[target_index].has_been_joined = true;
-    tcb_array[target_index].return_value = NULL;
-    tcb_array[target_index].joined_by = -1;
-    tcb_array[target_index].start_routine = NULL;
-    tcb_array[target_index].arg = NULL;
-    memset(&tcb_array[target_index].context, 0, sizeof(jmp_buf));
-    unlock();
-    return 0;
+    if (num_throttled_groups > 0) {
+        unsigned long long release = next_unthrottle_ns();
+        if (release != 0 && (nearest == 0 || release < nearest)) {
+            nearest = release;
+        }
+    }
+    return nearest;
 }
-int sem_init(sem_t *sem, int pshared, unsigned value)
+// Block the process on the futex of every pshared semaphore a thread here
+// is parked on, so a post to any of them wakes it at once. Returns false,
+// without sleeping, if FUTEX_WAITV is unavailable (before Linux 5.16) or
+// there are too many semaphores for one call.
+static bool futex_waitv_works = true;
+static bool wait_shared_futexes(bool bounded, unsigned long long limit_ns)
 {
-    if (pshared != 0 || value >= SEM_VALUE_MAX) {
-        return -1;  
+    if (!futex_waitv_works) {
+        return false;
     }
-    lock();  
-    SemaphoreData* data = (SemaphoreData*)malloc(sizeof(SemaphoreData));
-    if (data == NULL) {
-        unlock();
-        return -1;  
+    struct futex_waitv waiters[FUTEX_WAITV_MAX];
+    int count = 0;
+    for (int i = 0; i < num_threads; i++) {
+        SharedSemaphore* shared = tcb_array[i].shared_wait;
+        if (shared == NULL) {
+            continue;
+        }
+        bool seen = false;
+        for (int j = 0; j < count && !seen; j++) {
+            seen = (waiters[j].uaddr == (unsigned long)&shared->value);
+        }
+        if (seen) {
+            continue;
+        }
+        if (count == FUTEX_WAITV_MAX) {
+            return false;
+        }
+        waiters[count].val = 0;
+        waiters[count].uaddr = (unsigned long)&shared->value;
+        waiters[count].flags = FUTEX_32;
+        waiters[count].__reserved = 0;
+        count++;
     }
-    data->initialized = true;
-    data->value = value;  
-    data->queue_capacity = 16;  
-    data->queue_size = 0;       
-    data->waiting_queue = (int*)malloc(sizeof(int) * data->queue_capacity);
-    if (data->waiting_queue == NULL) {
-        free(data);  
-        unlock();
-        return -1;  
+    // The timeout is absolute
+    struct timespec timeout;
+    if (bounded) {
+        unsigned long long until = monotonic_ns() + limit_ns;
+        timeout.tv_sec = until / 1000000000ULL;
+        timeout.tv_nsec = until % 1000000000ULL;
     }
-    if (!add_semaphore_mapping(sem, data)) {
-        free(data->waiting_queue);
-        free(data);
-        unlock();
-        return -1;  
+    if (syscall(SYS_futex_waitv, waiters, count, 0, bounded ? &timeout : NULL,
+                CLOCK_MONOTONIC) == -1 && errno == ENOSYS) {
+        futex_waitv_works = false;
+        return false;
     }
-    unlock();
-    return 0;  
+    return true;
 }
-int sem_destroy(sem_t *sem)
+// Block the whole process until something may have made a thread runnable.
+// Returns false if there is nothing external to wait for.
+static bool wait_for_events()
 {
-    lock();  
-    SemaphoreData* data = get_semaphore_data(sem);
-    if (data == NULL || !data->initialized) {
-        unlock();
-        return -1;  
+    if (num_fd_waiters == 0 && num_shared_waiters == 0 && num_timed_waiters == 0 &&
+        num_throttled_groups == 0) {
+        return false;
     }
-    free(data->waiting_queue);
-    free(data);
-    remove_semaphore_mapping(sem);
-    unlock();
-    return 0;  
+    unsigned long long deadline = next_deadline_ns();
+    if (virtual_time && deadline != 0) {
+        // Outside events first; only then is it safe to skip ahead
+        if (num_fd_waiters > 0 && poll_fd_events(0) > 0) {
+            return true;
+        }
+        if (num_shared_waiters > 0 && poll_shared_waiters()) {
+            return true;
+        }
+        if (deadline > virtual_now_ns) {
+            virtual_now_ns = deadline;
+        }
+        expire_timed_waiters();
+        return true;
+    }
+    // Sleep until the nearest deadline
+    bool bounded = (deadline != 0);
+    unsigned long long limit_ns = 0;
+    if (bounded) {
+        unsigned long long now = monotonic_ns();
+        limit_ns = (deadline > now) ? deadline - now : 0;
+    }
+    if (num_shared_waiters > 0 && num_fd_waiters == 0 && (!bounded || limit_ns > 0) &&
+        wait_shared_futexes(bounded, limit_ns)) {
+        limit_ns = 0;
+    } else if (num_shared_waiters > 0 &&
+               (!bounded || limit_ns > TIMER_INTERVAL_MS * 1000000ULL)) {
+        // Shared semaphores can only be polled here, so the sleep is
+        // bounded while any are waited on
+        limit_ns = TIMER_INTERVAL_MS * 1000000ULL;
+        bounded = true;
+    }
+    if (num_fd_waiters > 0) {
+        int timeout_ms = -1;
+        if (bounded) {
+            // Round up so a timed waiter is never woken early
+            unsigned long long ms = (limit_ns + 999999) / 1000000;
+            timeout_ms = (ms > INT_MAX) ? INT_MAX : (int)ms;
+        }
+        poll_fd_events(timeout_ms);
+    } else if (limit_ns > 0) {
+        struct timespec timeout;
+        timeout.tv_sec = limit_ns / 1000000000ULL;
+        timeout.tv_nsec = limit_ns % 1000000000ULL;
+        bool slept = false;
+        // Sleep on one futex; the timeout bounds the delay for the others
+        for (int i = 0; i < num_threads && num_shared_waiters > 0; i++) {
+            if (tcb_array[i].shared_wait != NULL) {
+                futex(&tcb_array[i].shared_wait->value, FUTEX_WAIT, 0, &timeout);
+                slept = true;
+                break;
+            }
+        }
+        if (!slept) {
+            // Directly, as nanosleep itself is interposed below
+            syscall(SYS_nanosleep, &timeout, NULL);
+        }
+    }
+    // Time spent idle here is not charged to whichever thread runs next, and
+    // a tick left pending by the sleep is not reported as held off by a lock
+    slice_start_ns = preempt_clock_ns();
+    skip_missed_ticks(slice_start_ns);
+    if (num_timed_waiters > 0) {
+        expire_timed_waiters();
+    }
+    return true;
 }
-int sem_wait(sem_t *sem)
+static void thread_wrapper()
 {
-    lock();  
-    SemaphoreData* data = get_semaphore_data(sem);
-    if (data == NULL || !data->initialized) {
-        unlock();
-        return -1;  
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    TCB* current_tcb = &tcb_array[current_thread];
+    void* result = current_tcb->start_routine(current_tcb->arg);
+    pthread_exit(result);  
+}
+// True once every thread has exited, ignoring daemon threads (library
+// workers), which never keep the process alive on their own
+static bool all_threads_exited()
+{
+    for (int i = 0; i < num_threads; i++) {
+        if (tcb_array[i].status != EXITED && !tcb_array[i].daemon) {
+            return false;
+        }
     }
-    if (data->value > 0) {
-        data->value--;  
-        unlock();
-        return 0;  
+    return true;
+}
+static void schedule()
+{
+    unsigned long long ran = account_slice();
+    if (tcb_array[current_thread].group != NULL) {
+        group_charge(current_thread, ran);
     }
-    if (data->queue_size >= data->queue_capacity) {
-        int new_capacity = data->queue_capacity * 2;
-        int* new_queue = (int*)realloc(data->waiting_queue,
-                                       sizeof(int) * new_capacity);
-        if (new_queue == NULL) {
-            unlock();
-            return -1;  
+    if (sched_policy == UTHREAD_SCHED_STRIDE) {
+        // Advance pass in proportion to the CPU used. A minimum charge keeps
+        // a thread that yields at once from being picked straight back.
+        TCB* tcb = &tcb_array[current_thread];
+        unsigned long long slice = TIMER_INTERVAL_MS * 1000000ULL;
+        unsigned long long charge = tcb->stride * ran / slice;
+        tcb->pass += (charge > tcb->stride / 16) ? charge : tcb->stride / 16;
+        if (tcb->status == READY && tcb->heap_index == -1 &&
+            !thread_throttled(current_thread)) {
+            stride_heap_push(current_thread);
         }
-        data->waiting_queue = new_queue;
-        data->queue_capacity = new_capacity;
     }
-    data->waiting_queue[data->queue_size++] = current_thread;
-    tcb_array[current_thread].status = BLOCKED;
+    // Being switched out outside a read-side section is a quiescent state
+    context_switches++;
+    if (tcb_array[current_thread].rcu_nesting == 0) {
+        tcb_array[current_thread].rcu_quiescent = context_switches;
+    }
+    if (tcb_array[current_thread].ebr_nesting == 0) {
+        tcb_array[current_thread].ebr_epoch = ebr_global_epoch;
+    }
+    // Blocking or yielding ends a hog streak and undoes a demotion
+    if (!involuntary_switch) {
+        tcb_array[current_thread].hog_run_ns = 0;
+        tcb_array[current_thread].hog_streak = 0;
+        tcb_array[current_thread].demoted = false;
+    }
+    involuntary_switch = false;
+    int original_thread = current_thread;
+    do {
+        if (num_throttled_groups > 0) {
+            refresh_throttled_groups();
+        }
+        if (num_shared_waiters > 0) {
+            poll_shared_waiters();
+        }
+        if (num_fd_waiters > 0) {
+            poll_fd_events(0);
+        }
+        if (num_timed_waiters > 0) {
+            expire_timed_waiters();
+        }
+        if (sched_policy == UTHREAD_SCHED_STRIDE) {
+            int next = stride_pick();
+            if (next != -1) {
+                current_thread = next;
+                tcb_array[current_thread].status = RUNNING;
+                stride_global_pass = tcb_array[current_thread].pass;
+                return;
+            }
+        }
+        int checked_count = 0;
+        int background = -1;
+        while (sched_policy == UTHREAD_SCHED_ROUND_ROBIN && checked_count < num_threads) {
+            current_thread = (current_thread + 1) % num_threads;
+            checked_count++;
+            if (tcb_array[current_thread].status == READY &&
+                !thread_throttled(current_thread)) {
+                if (tcb_array[current_thread].background ||
+                    tcb_array[current_thread].demoted) {
+                    // Background threads only get slices nobody else wants
+                    if (background == -1) {
+                        background = current_thread;
+                    }
+                    continue;
+                }
+                tcb_array[current_thread].status = RUNNING;
+                return;
+            }
+        }
+        if (sched_policy == UTHREAD_SCHED_ROUND_ROBIN && background != -1) {
+            current_thread = background;
+            tcb_array[current_thread].status = RUNNING;
+            return;
+        }
+        if (all_threads_exited()) {
+            cleanup_all_resources();
+            exit(0);
+        }
+    } while (wait_for_events());
+    current_thread = original_thread;
+    if (tcb_array[current_thread].status != EXITED &&
+        tcb_array[current_thread].status != BLOCKED) {
+        tcb_array[current_thread].status = RUNNING;
+    }
+}
+// Save the current thread's context and resume the next runnable thread.
+// Must be called with PREEMPT_SIGNAL blocked. Returns once this thread is
+// resumed, still with it blocked: whoever resumes a context is responsible for
+// restoring its signal mask, so no tick can land between unmasking and the
+// jump and overwrite the wrong thread's context.
+static void context_switch()
+{
     int old_thread = current_thread;
+    save_fpu_state(&tcb_array[old_thread]);
     if (setjmp(tcb_array[old_thread].context) == 0) {
         schedule();
-        unlock();
+        group_limit_slice(current_thread);
+        restore_fpu_state(&tcb_array[current_thread]);
         longjmp(tcb_array[current_thread].context, 1);
     }
-    unlock();
-    return 0;  
 }
-int sem_post(sem_t *sem)
+// Called on each tick for the interrupted thread: count full slices and
+// measure how late the tick arrived. Reports at most one reason.
+static void check_hog(int* reason, unsigned long long* amount)
 {
-    lock();  
-    SemaphoreData* data = get_semaphore_data(sem);
-    if (data == NULL || !data->initialized) {
-        unlock();
-        return -1;  
+    TCB* tcb = &tcb_array[current_thread];
+    unsigned long long now = preempt_clock_ns();
+    if (next_tick_ns != 0 && now > next_tick_ns) {
+        unsigned long long late = now - next_tick_ns;
+        if (late > tcb->max_lock_ns) {
+            tcb->max_lock_ns = late;
+        }
+        if (hog_lock_limit_ns != 0 && late >= hog_lock_limit_ns) {
+            tcb->hog_lock_flags++;
+            *reason = UTHREAD_HOG_LOCK;
+            *amount = late;
+        }
     }
-    if (data->queue_size > 0) {
-        int woken_thread = data->waiting_queue[0];
-        for (int i = 0; i < data->queue_size - 1; i++) {
-            data->waiting_queue[i] = data->waiting_queue[i + 1];
+    skip_missed_ticks(now);
+    // Streaks are measured in run time, so slices cut short by ticks brought
+    // forward for sleepers still add up
+    unsigned long long slice = TIMER_INTERVAL_MS * 1000000ULL;
+    unsigned long long ran = now - slice_start_ns;
+    if (ran >= slice * 3 / 4) {
+        tcb->full_slices++;
+    }
+    unsigned long previous = tcb->hog_streak;
+    tcb->hog_run_ns += ran;
+    tcb->hog_streak = tcb->hog_run_ns / slice;
+    if (tcb->hog_streak > tcb->hog_max_streak) {
+        tcb->hog_max_streak = tcb->hog_streak;
+    }
+    if (hog_slice_limit != 0 && previous < hog_slice_limit &&
+        tcb->hog_streak >= hog_slice_limit) {
+        tcb->hog_slice_flags++;
+        if (hog_demote) {
+            tcb->demoted = true;
         }
-        data->queue_size--;
-        tcb_array[woken_thread].status = READY;
-    } else {
-        if (data->value < SEM_VALUE_MAX - 1) {
-            data->value++;
-        } else {
-            unlock();
-            return -1;  
+        if (*reason == -1) {
+            *reason = UTHREAD_HOG_SLICES;
+            *amount = tcb->hog_streak;
         }
     }
+}
+static void signal_handler(int signo, siginfo_t* info, void* ucontext)
+{
+    (void)signo;  
+    (void)info;
+    sigset_t oldset, newset;
+    sigemptyset(&newset);
+    sigaddset(&newset, PREEMPT_SIGNAL);
+    sigprocmask(SIG_BLOCK, &newset, &oldset);
+    if (tcb_array[current_thread].status == RUNNING) {
+        tcb_array[current_thread].status = READY;
+    }
+    int hog_reason = -1;
+    unsigned long long hog_amount = 0;
+    check_hog(&hog_reason, &hog_amount);
+    involuntary_switch = true;
+    unsigned long switches_before = context_switches;
+    context_switch();
+    if (hog_reason != -1 && hog_callback != NULL) {
+        // Reported once the offender runs again, still with ticks blocked
+        hog_callback((pthread_t)(long)current_thread, hog_reason, hog_amount);
+    }
+    // Our own pass through schedule() counts once; anything more means other
+    // threads ran, so an interrupted restartable region must start over
+    if (num_rseq_regions > 0 && context_switches - switches_before > 1) {
+        greg_t* pc = &((ucontext_t*)ucontext)->uc_mcontext.gregs[REG_RIP];
+        for (int i = 0; i < num_rseq_regions; i++) {
+            if ((unsigned long)*pc >= rseq_regions[i].start &&
+                (unsigned long)*pc < rseq_regions[i].end) {
+                *pc = (greg_t)rseq_regions[i].abort_ip;
+                break;
+            }
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldset, NULL);
+}
+static void cleanup_all_resources()
+{
+    // Prevent double-cleanup if called both explicitly and via atexit()
+    if (!initialized) {
+        return;
+    }
+
+    // Block the preemption signal first to prevent any ticks during cleanup
+    sigset_t signal_set, old_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, PREEMPT_SIGNAL);
+    sigprocmask(SIG_BLOCK, &signal_set, &old_set);
+
+    // Disable the timer
+    timer_delete(preempt_timer);
+
+    // Free all thread stacks and clean up TCB entries
+    // Only clean up threads that have been joined OR never started
+    // Zombie threads (exited but not joined) should also be cleaned up at program exit
+    int threads_to_clean = num_threads;
+    for (int i = 0; i < threads_to_clean; i++) {
+        // Free stack for all threads except current (thread 0's stack is NULL anyway)
+        // At program exit, we need to free ALL allocated stacks, including zombies
+        if (i != current_thread && tcb_array[i].stack != NULL) {
+            free_thread_stack(&tcb_array[i]);
+        }
+
+        // Don't leave our parked threads counted in other processes' view
+        if (tcb_array[i].shared_wait != NULL) {
+            __atomic_fetch_sub(&tcb_array[i].shared_wait->waiters, 1,
+                               __ATOMIC_RELAXED);
+            tcb_array[i].shared_wait = NULL;
+        }
+
+        close_splice_pipe(&tcb_array[i]);
+
+        // Release limbo list storage; the retired objects die with the process
+        for (int e = 0; e < 3; e++) {
+            free(tcb_array[i].ebr_limbo[e].ptrs);
+            free(tcb_array[i].ebr_limbo[e].free_fns);
+            memset(&tcb_array[i].ebr_limbo[e], 0, sizeof(EbrLimbo));
+        }
+
+        // Clean up TCB entry completely - reset ALL fields to clean state
+        tcb_array[i].thread_id = 0;
+        tcb_array[i].status = EXITED;
+        tcb_array[i].has_been_joined = true;
+        tcb_array[i].return_value = NULL;
+        tcb_array[i].joined_by = -1;
+        tcb_array[i].start_routine = NULL;
+        tcb_array[i].arg = NULL;
+        // Clear the context (saved registers) - zero it out
+        memset(&tcb_array[i].context, 0, sizeof(jmp_buf));
+    }
+
+    // Free all semaphore data structures
+    // Only clean up semaphores that are still allocated (up to num_semaphores)
+    // Going through all MAX_SEMAPHORES could access uninitialized/garbage pointers
+    int sems_to_clean = num_semaphores;
+    for (int i = 0; i < sems_to_clean; i++) {
+        if (semaphore_map[i] != NULL) {
+            // Mark as uninitialized before freeing
+            semaphore_map[i]->initialized = false;
+            semaphore_map[i]->value = 0;
+            semaphore_map[i]->queue_size = 0;
+
+            if (semaphore_map[i]->waiting_queue != NULL) {
+                free(semaphore_map[i]->waiting_queue);
+                semaphore_map[i]->waiting_queue = NULL;
+            }
+            free(semaphore_map[i]);
+            semaphore_map[i] = NULL;
+        }
+        semaphore_keys[i] = NULL;
+    }
+
+    // Clear remaining keys
+    for (int i = sems_to_clean; i < MAX_SEMAPHORES; i++) {
+        semaphore_keys[i] = NULL;
+    }
+
+    // Reset semaphore counters
+    num_semaphores = 0;
+    num_shared_waiters = 0;
+
+    // Drop RCU callbacks that never reached the end of their grace period
+    for (int i = 0; i < 2; i++) {
+        RcuCallback* cb = (i == 0) ? rcu_pending : rcu_waiting;
+        while (cb != NULL) {
+            RcuCallback* next = cb->next;
+            free(cb);
+            cb = next;
+        }
+    }
+    rcu_pending = NULL;
+    rcu_waiting = NULL;
+
+    // Unmap all named semaphores still open in this process
+    for (int i = 0; i <= NAMED_SEM_BUCKETS; i++) {
+        NamedSemaphore** list = (i < NAMED_SEM_BUCKETS) ? &named_semaphores[i]
+                                                        : &unlinked_named_semaphores;
+        while (*list != NULL) {
+            NamedSemaphore* entry = *list;
+            *list = entry->next;
+            munmap(entry->sem, sizeof(sem_t));
+            free(entry->name);
+            free(entry);
+        }
+    }
+
+    num_rseq_regions = 0;
+
+    sched_policy = UTHREAD_SCHED_ROUND_ROBIN;
+    stride_heap_size = 0;
+    stride_global_pass = 0;
+    // Groups belong to the application; just forget them
+    group_list = NULL;
+    num_throttled_groups = 0;
+
+    // Close the reactor; parked fd waiters die with their threads
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    free(fd_table);
+    fd_table = NULL;
+    fd_table_size = 0;
+    num_fd_waiters = 0;
+    num_timed_waiters = 0;
+    virtual_time = false;
+
+    // Armed timers belong to the application; just forget the wheel
+    memset(timer_wheel, 0, sizeof(timer_wheel));
+    memset(timer_wheel_count, 0, sizeof(timer_wheel_count));
+    timer_thread = -1;
+    timer_thread_parked = false;
+
+    // Reset threading system state
+    num_threads = 0;
+    current_thread = 0;
+    initialized = false;
+
+    // Restore the original handler (as it was before init_threading)
+    sigaction(PREEMPT_SIGNAL, &original_sigaction, NULL);
+
+    // Restore the original signal mask (as it was before init_threading)
+    sigprocmask(SIG_SETMASK, &original_sigmask, NULL);
+}
+static void init_threading()
+{
+    if (initialized) {
+        return;
+    }
+    initialized = true;
+
+    // Initialize all TCB entries to a clean state
+    for (int i = 0; i < MAX_THREADS; i++) {
+        tcb_array[i].thread_id = i;
+        tcb_array[i].stack = NULL;
+        tcb_array[i].stack_block = NULL;
+        tcb_array[i].status = EXITED;
+        tcb_array[i].start_routine = NULL;
+        tcb_array[i].arg = NULL;
+        tcb_array[i].return_value = NULL;
+        tcb_array[i].joined_by = -1;
+        tcb_array[i].has_been_joined = (i > 0); // All except thread 0 start as "joined"
+    }
+
+    // Set up the main thread (thread 0)
+    tcb_array[0].status = RUNNING;
+    tcb_array[0].has_been_joined = false;
+    tcb_array[0].uses_fpu_state = false;
+    save_fpu_state(&tcb_array[0]);
+    tcb_array[0].runtime_ns = 0;
+    tcb_array[0].shared_wait = NULL;
+    tcb_array[0].rcu_nesting = 0;
+    tcb_array[0].rcu_quiescent = context_switches;
+    tcb_array[0].ebr_nesting = 0;
+    tcb_array[0].ebr_epoch = ebr_global_epoch;
+    tcb_array[0].ebr_retired = 0;
+    tcb_array[0].daemon = false;
+    tcb_array[0].wait_fd = -1;
+    tcb_array[0].wait_deadline_ns = 0;
+    tcb_array[0].splice_pipe[0] = -1;
+    tcb_array[0].splice_pipe[1] = -1;
+    tcb_array[0].full_slices = 0;
+    tcb_array[0].hog_run_ns = 0;
+    tcb_array[0].hog_streak = 0;
+    tcb_array[0].hog_max_streak = 0;
+    tcb_array[0].hog_slice_flags = 0;
+    tcb_array[0].max_lock_ns = 0;
+    tcb_array[0].hog_lock_flags = 0;
+    tcb_array[0].background = false;
+    tcb_array[0].demoted = false;
+    tcb_array[0].tickets = DEFAULT_TICKETS;
+    tcb_array[0].stride = STRIDE_ONE / DEFAULT_TICKETS;
+    tcb_array[0].pass = 0;
+    tcb_array[0].heap_index = -1;
+    tcb_array[0].group = NULL;
+    num_threads = 1;
+    current_thread = 0;
+
+    // Capture a valid jmp_buf once; new threads only patch RSP/RBP into a copy
+    setjmp(context_template);
+    mangled_wrapper_pc = i64_ptr_mangle((long int)thread_wrapper);
+
+    // Save the original signal handler and mask FIRST, before any modifications
+    sigaction(PREEMPT_SIGNAL, NULL, &original_sigaction);
+    sigprocmask(SIG_SETMASK, NULL, &original_sigmask);
+
+    // Register cleanup function to be called at program exit
+    atexit(cleanup_all_resources);
+
+    // Install our custom signal handler. SA_RESTART makes the kernel restart
+    // slow syscalls (read/write on pipes and sockets, wait, accept, ...) that
+    // a tick interrupts instead of failing them with EINTR.
+    struct sigaction sa;
+    sa.sa_sigaction = signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(PREEMPT_SIGNAL, &sa, NULL);
+
+    // A POSIX timer can deliver any signal, unlike setitimer's fixed SIGALRM
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = PREEMPT_SIGNAL;
+    timer_create(PREEMPT_CLOCK, &sev, &preempt_timer);
+    slice_start_ns = preempt_clock_ns();
+    next_tick_ns = slice_start_ns + TIMER_INTERVAL_MS * 1000000ULL;
+    struct itimerspec timer;
+    timer.it_value.tv_sec = 0;
+    timer.it_value.tv_nsec = TIMER_INTERVAL_MS * 1000000L;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_nsec = TIMER_INTERVAL_MS * 1000000L;
+    timer_settime(preempt_timer, 0, &timer, NULL);
+}
+void lock()
+{
+    sigset_t signal_set;
+    sigemptyset(&signal_set);           
+    sigaddset(&signal_set, PREEMPT_SIGNAL);    
+    sigprocmask(SIG_BLOCK, &signal_set, NULL);  
+}
+void unlock()
+{
+    sigset_t signal_set;
+    sigemptyset(&signal_set);           
+    sigaddset(&signal_set, PREEMPT_SIGNAL);    
+    sigprocmask(SIG_UNBLOCK, &signal_set, NULL);  
+}
+// malloc and free skip their own locking while the process has a single
+// kernel thread, so a thread preempted inside one of them leaves the heap
+// half-updated for the next thread that allocates. The library's own
+// allocations go through these, which may also be called under lock().
+static void heap_block(sigset_t* old_set)
+{
+    sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, PREEMPT_SIGNAL);
+    sigprocmask(SIG_BLOCK, &signal_set, old_set);
+}
+static void* heap_malloc(size_t size)
+{
+    sigset_t old_set;
+    heap_block(&old_set);
+    void* ptr = malloc(size);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return ptr;
+}
+static void* heap_calloc(size_t count, size_t size)
+{
+    sigset_t old_set;
+    heap_block(&old_set);
+    void* ptr = calloc(count, size);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return ptr;
+}
+static void* heap_realloc(void* ptr, size_t size)
+{
+    sigset_t old_set;
+    heap_block(&old_set);
+    void* new_ptr = realloc(ptr, size);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return new_ptr;
+}
+static void* heap_aligned_alloc(size_t alignment, size_t size)
+{
+    sigset_t old_set;
+    heap_block(&old_set);
+    void* ptr = aligned_alloc(alignment, size);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return ptr;
+}
+static void heap_free(void* ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    sigset_t old_set;
+    heap_block(&old_set);
+    free(ptr);
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+}
+// Give up the CPU but stay runnable
+static void yield_thread()
+{
+    if (!initialized) {
+        return;
+    }
+    lock();
+    if (tcb_array[current_thread].status == RUNNING) {
+        tcb_array[current_thread].status = READY;
+    }
+    context_switch();
+    unlock();
+}
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void*), void *arg)
+{
+    (void)attr;
+    if (!initialized) {
+        init_threading();
+    }
+
+    lock();
+
+    // Never reuse thread IDs - simpler and cleaner
+    // Each thread gets a unique ID from 0 to MAX_THREADS-1
+    if (num_threads >= MAX_THREADS) {
+        unlock();
+        return -1;
+    }
+
+    int new_thread_id = num_threads;
+    num_threads++;
+
+    TCB* new_tcb = &tcb_array[new_thread_id];
+    new_tcb->thread_id = new_thread_id;
+    new_tcb->start_routine = start_routine;
+    new_tcb->arg = arg;
+    new_tcb->return_value = NULL;
+    new_tcb->joined_by = -1;
+    new_tcb->has_been_joined = false;
+    new_tcb->stack_block = NULL;
+
+    // Allocate stack for the new thread
+    new_tcb->stack = malloc(STACK_SIZE);
+    if (new_tcb->stack == NULL) {
+        num_threads--;
+        unlock();
+        return -1;
+    }
+    init_thread_context(new_tcb);
+    make_ready(new_thread_id);
+    *thread = (pthread_t)(long)new_thread_id;
+    unlock();  
+    return 0;
+}
+// Create n threads running start_routine(args[i]) under a single lock() and a
+// single stack allocation. Either all n threads are created or none are.
+int uthread_create_batch(int n, void *(*start_routine)(void*), void **args,
+                         pthread_t *out)
+{
+    if (n <= 0 || start_routine == NULL || out == NULL) {
+        return -1;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+
+    lock();
+    if (num_threads + n > MAX_THREADS) {
+        unlock();
+        return -1;
+    }
+
+    // Refcount header padded to 16 bytes, followed by n contiguous stacks
+    char* block = (char*)malloc(16 + (size_t)n * STACK_SIZE);
+    if (block == NULL) {
+        unlock();
+        return -1;
+    }
+    *(int*)block = n;
+
+    int first_id = num_threads;
+    for (int i = 0; i < n; i++) {
+        TCB* new_tcb = &tcb_array[first_id + i];
+        new_tcb->thread_id = first_id + i;
+        new_tcb->start_routine = start_routine;
+        new_tcb->arg = (args != NULL) ? args[i] : NULL;
+        new_tcb->return_value = NULL;
+        new_tcb->joined_by = -1;
+        new_tcb->has_been_joined = false;
+        new_tcb->stack = block + 16 + (size_t)i * STACK_SIZE;
+        new_tcb->stack_block = block;
+        init_thread_context(new_tcb);
+        out[i] = (pthread_t)(long)(first_id + i);
+    }
+
+    // Publish all threads at once so none runs before the batch is complete
+    for (int i = 0; i < n; i++) {
+        make_ready(first_id + i);
+    }
+    num_threads += n;
+    unlock();
+    return 0;
+}
+void pthread_exit(void *value_ptr)
+{
+    lock();  
+    tcb_array[current_thread].return_value = value_ptr;
+    tcb_array[current_thread].status = EXITED;
+    close_splice_pipe(&tcb_array[current_thread]);
+    int joined_by = tcb_array[current_thread].joined_by;
+    if (joined_by != -1) {
+        make_ready(joined_by);
+    }
+    if (all_threads_exited()) {
+        cleanup_all_resources();
+        exit(0);
+    }
+    schedule();
+    group_limit_slice(current_thread);
+    restore_fpu_state(&tcb_array[current_thread]);
+    longjmp(tcb_array[current_thread].context, 1);
+}
+pthread_t pthread_self(void)
+{
+    return (pthread_t)(long)tcb_array[current_thread].thread_id;
+}
+// Nanoseconds the thread has spent scheduled, including the running slice
+unsigned long long uthread_runtime_ns(pthread_t thread)
+{
+    int index = (int)(long)thread;
+    if (!initialized || index < 0 || index >= num_threads ||
+        tcb_array[index].has_been_joined) {
+        return 0;
+    }
+    lock();
+    unsigned long long runtime = tcb_array[index].runtime_ns;
+    if (index == current_thread) {
+        runtime += preempt_clock_ns() - slice_start_ns;
+    }
+    unlock();
+    return runtime;
+}
+int pthread_join(pthread_t thread, void **value_ptr)
+{
+    lock();  
+    int target_index = -1;
+    for (int i = 0; i < num_threads; i++) {
+        if (tcb_array[i].thread_id == (int)(long)thread) {
+            target_index = i;
+            break;
+        }
+    }
+    if (target_index == -1) {
+        unlock();
+        return ESRCH;  
+    }
+    if (tcb_array[target_index].has_been_joined) {
+        unlock();
+        return EINVAL;
+    }
+    if (target_index == current_thread) {
+        unlock();
+        return EDEADLK;
+    }
+    if (tcb_array[target_index].status == EXITED) {
+        if (value_ptr != NULL) {
+            *value_ptr = tcb_array[target_index].return_value;
+        }
+        // Clean up the zombie thread's resources completely
+        free_thread_stack(&tcb_array[target_index]);
+        // Clear ALL TCB fields to show thread is fully cleaned up
+        tcb_array[target_index].thread_id = 0;
+        tcb_array[target_index].status = EXITED;
+        tcb_array[target_index].has_been_joined = true;
+        tcb_array[target_index].return_value = NULL;
+        tcb_array[target_index].joined_by = -1;
+        tcb_array[target_index].start_routine = NULL;
+        tcb_array[target_index].arg = NULL;
+        memset(&tcb_array[target_index].context, 0, sizeof(jmp_buf));
+        unlock();
+        return 0;
+    }
+    tcb_array[target_index].joined_by = current_thread;
+    tcb_array[current_thread].status = BLOCKED;
+    context_switch();
+    if (value_ptr != NULL) {
+        *value_ptr = tcb_array[target_index].return_value;
+    }
+    // Clean up the zombie thread's resources completely
+    free_thread_stack(&tcb_array[target_index]);
+    // Clear ALL TCB fields to show thread is fully cleaned up
+    tcb_array[target_index].thread_id = 0;
+    tcb_array[target_index].status = EXITED;
+    tcb_array[target_index].has_been_joined = true;
+    tcb_array[target_index].return_value = NULL;
+    tcb_array[target_index].joined_by = -1;
+    tcb_array[target_index].start_routine = NULL;
+    tcb_array[target_index].arg = NULL;
+    memset(&tcb_array[target_index].context, 0, sizeof(jmp_buf));
+    unlock();
+    return 0;
+}
+int sem_init(sem_t *sem, int pshared, unsigned value)
+{
+    if (value >= SEM_VALUE_MAX) {
+        return -1;  
+    }
+    if (pshared != 0) {
+        // All state lives in the (shared) sem_t itself, nothing to register
+        SharedSemaphore* shared = (SharedSemaphore*)sem;
+        shared->value = (int)value;
+        shared->waiters = 0;
+        __atomic_store_n(&shared->magic, SHARED_SEM_MAGIC, __ATOMIC_RELEASE);
+        return 0;
+    }
+    // sem_wait/sem_post check the magic first, so a sem_t reused after
+    // being process-shared must not keep it
+    __atomic_store_n(&((SharedSemaphore*)sem)->magic, 0, __ATOMIC_RELEASE);
+    lock();  
+    SemaphoreData* data = (SemaphoreData*)malloc(sizeof(SemaphoreData));
+    if (data == NULL) {
+        unlock();
+        return -1;  
+    }
+    data->initialized = true;
+    data->value = value;  
+    data->queue_capacity = 16;  
+    data->queue_size = 0;       
+    data->waiting_queue = (int*)malloc(sizeof(int) * data->queue_capacity);
+    if (data->waiting_queue == NULL) {
+        free(data);  
+        unlock();
+        return -1;  
+    }
+    if (!add_semaphore_mapping(sem, data)) {
+        free(data->waiting_queue);
+        free(data);
+        unlock();
+        return -1;  
+    }
+    unlock();
+    return 0;  
+}
+int sem_destroy(sem_t *sem)
+{
+    lock();  
+    SemaphoreData* data = get_semaphore_data(sem);
+    if (data == NULL) {
+        SharedSemaphore* shared = get_shared_semaphore(sem);
+        unlock();
+        if (shared == NULL) {
+            return -1;
+        }
+        __atomic_store_n(&shared->magic, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (!data->initialized) {
+        unlock();
+        return -1;  
+    }
+    free(data->waiting_queue);
+    free(data);
+    remove_semaphore_mapping(sem);
+    unlock();
+    return 0;  
+}
+static int shared_sem_wait(SharedSemaphore* shared)
+{
+    if (shared_sem_trywait(shared)) {
+        return 0;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    // Advertise the waiter before re-checking so a concurrent post wakes us
+    __atomic_fetch_add(&shared->waiters, 1, __ATOMIC_SEQ_CST);
+    if (shared_sem_trywait(shared)) {
+        __atomic_fetch_sub(&shared->waiters, 1, __ATOMIC_RELAXED);
+        unlock();
+        return 0;
+    }
+    // Park locally; poll_shared_waiters() takes the unit on our behalf
+    tcb_array[current_thread].shared_wait = shared;
+    tcb_array[current_thread].status = BLOCKED;
+    num_shared_waiters++;
+    context_switch();
+    unlock();
+    return 0;
+}
+static int shared_sem_post(SharedSemaphore* shared)
+{
+    int value = __atomic_load_n(&shared->value, __ATOMIC_RELAXED);
+    do {
+        if (value >= SEM_VALUE_MAX - 1) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&shared->value, &value, value + 1, true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    if (__atomic_load_n(&shared->waiters, __ATOMIC_SEQ_CST) > 0) {
+        futex(&shared->value, FUTEX_WAKE, 1, NULL);
+    }
+    return 0;
+}
+int sem_wait(sem_t *sem)
+{
+    // Process-shared semaphores keep all state in the sem_t, so the
+    // uncontended path needs neither lock() nor the local lookup
+    SharedSemaphore* shared = get_shared_semaphore(sem);
+    if (shared != NULL) {
+        return shared_sem_wait(shared);
+    }
+    lock();  
+    SemaphoreData* data = get_semaphore_data(sem);
+    if (data == NULL) {
+        unlock();
+        return -1;
+    }
+    if (!data->initialized) {
+        unlock();
+        return -1;  
+    }
+    if (data->value > 0) {
+        data->value--;  
+        unlock();
+        return 0;  
+    }
+    if (data->queue_size >= data->queue_capacity) {
+        int new_capacity = data->queue_capacity * 2;
+        int* new_queue = (int*)realloc(data->waiting_queue,
+                                       sizeof(int) * new_capacity);
+        if (new_queue == NULL) {
+            unlock();
+            return -1;  
+        }
+        data->waiting_queue = new_queue;
+        data->queue_capacity = new_capacity;
+    }
+    data->waiting_queue[data->queue_size++] = current_thread;
+    tcb_array[current_thread].status = BLOCKED;
+    context_switch();
+    unlock();
+    return 0;  
+}
+int sem_post(sem_t *sem)
+{
+    SharedSemaphore* shared = get_shared_semaphore(sem);
+    if (shared != NULL) {
+        return shared_sem_post(shared);
+    }
+    lock();  
+    SemaphoreData* data = get_semaphore_data(sem);
+    if (data == NULL) {
+        unlock();
+        return -1;
+    }
+    if (!data->initialized) {
+        unlock();
+        return -1;  
+    }
+    if (data->queue_size > 0) {
+        int woken_thread = data->waiting_queue[0];
+        for (int i = 0; i < data->queue_size - 1; i++) {
+            data->waiting_queue[i] = data->waiting_queue[i + 1];
+        }
+        data->queue_size--;
+        make_ready(woken_thread);
+    } else {
+        if (data->value < SEM_VALUE_MAX - 1) {
+            data->value++;
+        } else {
+            unlock();
+            return -1;  
+        }
+    }
+    unlock();
+    return 0;
+}
+static unsigned int named_sem_hash(const char* name)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const char* p = name; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash % NAMED_SEM_BUCKETS;
+}
+static NamedSemaphore* find_named_semaphore(const char* name)
+{
+    NamedSemaphore* entry = named_semaphores[named_sem_hash(name)];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+static void unlink_named_entry(NamedSemaphore* entry)
+{
+    NamedSemaphore** list = entry->linked ? &named_semaphores[named_sem_hash(entry->name)]
+                                          : &unlinked_named_semaphores;
+    while (*list != entry) {
+        list = &(*list)->next;
+    }
+    *list = entry->next;
+}
+static bool named_sem_path(const char* name, char* path, size_t size)
+{
+    if (snprintf(path, size, "%s%s", NAMED_SEM_PREFIX, name + 1) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+// Map the shm object backing a named semaphore, creating and initializing it
+// if requested. Returns NULL with errno set on failure.
+static sem_t* map_named_semaphore(const char* name, int oflag, mode_t mode,
+                                  unsigned value)
+{
+    char path[NAME_MAX + 1];
+    if (!named_sem_path(name, path, sizeof(path))) {
+        return NULL;
+    }
+    bool created = false;
+    int fd = -1;
+    if (oflag & O_CREAT) {
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, mode);
+        if (fd >= 0) {
+            created = true;
+        } else if (errno != EEXIST || (oflag & O_EXCL)) {
+            return NULL;
+        }
+    }
+    if (fd < 0) {
+        fd = shm_open(path, O_RDWR, 0);
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+    if (created && ftruncate(fd, sizeof(sem_t)) != 0) {
+        int saved_errno = errno;
+        shm_unlink(path);
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    // A concurrent creator may not have sized or initialized the object
+    // yet. This runs under lock(), so give up rather than spin forever if
+    // it died in between or the object was made by another implementation.
+    unsigned long long give_up = monotonic_ns() + NAMED_SEM_INIT_TIMEOUT_NS;
+    struct timespec pause = { 0, 100000 };
+    struct stat st;
+    while (!created) {
+        if (fstat(fd, &st) != 0) {
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return NULL;
+        }
+        if (st.st_size >= (off_t)sizeof(sem_t)) {
+            break;
+        }
+        if (monotonic_ns() >= give_up) {
+            close(fd);
+            errno = EAGAIN;
+            return NULL;
+        }
+        syscall(SYS_nanosleep, &pause, NULL);
+    }
+    void* addr = mmap(NULL, sizeof(sem_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    sem_t* sem = (sem_t*)addr;
+    if (created) {
+        sem_init(sem, 1, value);
+    } else {
+        while (get_shared_semaphore(sem) == NULL) {
+            if (monotonic_ns() >= give_up) {
+                munmap(addr, sizeof(sem_t));
+                errno = EINVAL;
+                return NULL;
+            }
+            syscall(SYS_nanosleep, &pause, NULL);
+        }
+    }
+    return sem;
+}
+sem_t *sem_open(const char *name, int oflag, ...)
+{
+    mode_t mode = 0;
+    unsigned value = 0;
+    if (oflag & O_CREAT) {
+        va_list ap;
+        va_start(ap, oflag);
+        mode = (mode_t)va_arg(ap, int);
+        value = va_arg(ap, unsigned);
+        va_end(ap);
+        if (value >= SEM_VALUE_MAX) {
+            errno = EINVAL;
+            return SEM_FAILED;
+        }
+    }
+    if (name[0] != '/' || name[1] == '\0' ||
+        strchr(name + 1, '/') != NULL) {
+        errno = EINVAL;
+        return SEM_FAILED;
+    }
+
+    lock();
+    NamedSemaphore* entry = find_named_semaphore(name);
+    if (entry != NULL) {
+        if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+            unlock();
+            errno = EEXIST;
+            return SEM_FAILED;
+        }
+        entry->refs++;
+        unlock();
+        return entry->sem;
+    }
+
+    entry = (NamedSemaphore*)malloc(sizeof(NamedSemaphore));
+    char* name_copy = strdup(name);
+    if (entry == NULL || name_copy == NULL) {
+        free(entry);
+        free(name_copy);
+        unlock();
+        errno = ENOMEM;
+        return SEM_FAILED;
+    }
+    sem_t* sem = map_named_semaphore(name, oflag, mode, value);
+    if (sem == NULL) {
+        int saved_errno = errno;
+        free(entry);
+        free(name_copy);
+        unlock();
+        errno = saved_errno;
+        return SEM_FAILED;
+    }
+    unsigned int bucket = named_sem_hash(name);
+    entry->name = name_copy;
+    entry->sem = sem;
+    entry->refs = 1;
+    entry->linked = true;
+    entry->next = named_semaphores[bucket];
+    named_semaphores[bucket] = entry;
+    unlock();
+    return sem;
+}
+int sem_close(sem_t *sem)
+{
+    lock();
+    NamedSemaphore* found = NULL;
+    for (int i = 0; i <= NAMED_SEM_BUCKETS && found == NULL; i++) {
+        NamedSemaphore* entry = (i < NAMED_SEM_BUCKETS) ? named_semaphores[i]
+                                                        : unlinked_named_semaphores;
+        for (; entry != NULL; entry = entry->next) {
+            if (entry->sem == sem) {
+                found = entry;
+                break;
+            }
+        }
+    }
+    if (found == NULL) {
+        unlock();
+        errno = EINVAL;
+        return -1;
+    }
+    if (--found->refs == 0) {
+        unlink_named_entry(found);
+        munmap(found->sem, sizeof(sem_t));
+        free(found->name);
+        free(found);
+    }
+    unlock();
+    return 0;
+}
+int sem_unlink(const char *name)
+{
+    if (name[0] != '/') {
+        errno = EINVAL;
+        return -1;
+    }
+    char path[NAME_MAX + 1];
+    if (!named_sem_path(name, path, sizeof(path))) {
+        return -1;
+    }
+    lock();
+    if (shm_unlink(path) != 0) {
+        unlock();
+        return -1;
+    }
+    // Existing handles stay valid, but the name now refers to a new semaphore
+    NamedSemaphore* entry = find_named_semaphore(name);
+    if (entry != NULL) {
+        unlink_named_entry(entry);
+        entry->linked = false;
+        entry->next = unlinked_named_semaphores;
+        unlinked_named_semaphores = entry;
+    }
+    unlock();
+    return 0;
+}
+// Readers only touch their own TCB: with a single kernel thread there is no
+// other CPU to order against, so no atomics or fences are needed.
+void uthread_rcu_read_lock(void)
+{
+    tcb_array[current_thread].rcu_nesting++;
+    asm volatile("" ::: "memory");
+}
+void uthread_rcu_read_unlock(void)
+{
+    asm volatile("" ::: "memory");
+    TCB* tcb = &tcb_array[current_thread];
+    // Leaving the outermost section is also a quiescent state, so a reader
+    // that is always preempted mid-section cannot stall a grace period
+    if (--tcb->rcu_nesting == 0) {
+        tcb->rcu_quiescent = context_switches;
+    }
+}
+// True once every thread that may have been inside a read-side section at
+// switch count 'since' has left it or been switched out quiescent
+static bool rcu_grace_period_over(unsigned long since)
+{
+    for (int i = 0; i < num_threads; i++) {
+        if (tcb_array[i].status == EXITED || tcb_array[i].rcu_nesting == 0) {
+            continue;
+        }
+        if (tcb_array[i].rcu_quiescent <= since) {
+            return false;
+        }
+    }
+    return true;
+}
+void uthread_synchronize_rcu(void)
+{
+    if (!initialized) {
+        return;
+    }
+    lock();
+    unsigned long since = context_switches;
+    while (!rcu_grace_period_over(since)) {
+        unlock();
+        yield_thread();
+        lock();
+    }
+    unlock();
+}
+// Run callbacks whose grace period has ended and start the next batch.
+// Callbacks run in thread context, never from the preemption handler.
+static void rcu_process_callbacks()
+{
+    lock();
+    RcuCallback* done = NULL;
+    if (rcu_waiting != NULL && rcu_grace_period_over(rcu_waiting_since)) {
+        done = rcu_waiting;
+        rcu_waiting = NULL;
+    }
+    if (rcu_waiting == NULL && rcu_pending != NULL) {
+        rcu_waiting = rcu_pending;
+        rcu_waiting_since = context_switches;
+        rcu_pending = NULL;
+    }
+    unlock();
+    while (done != NULL) {
+        RcuCallback* next = done->next;
+        done->func(done->arg);
+        heap_free(done);
+        done = next;
+    }
+}
+int uthread_call_rcu(void (*func)(void*), void* arg)
+{
+    RcuCallback* cb = (RcuCallback*)heap_malloc(sizeof(RcuCallback));
+    if (cb == NULL) {
+        return -1;
+    }
+    cb->func = func;
+    cb->arg = arg;
+    lock();
+    cb->next = rcu_pending;
+    rcu_pending = cb;
+    unlock();
+    rcu_process_callbacks();
+    return 0;
+}
+// Wait until every callback queued so far has run
+void uthread_rcu_barrier(void)
+{
+    rcu_process_callbacks();
+    while (rcu_pending != NULL || rcu_waiting != NULL) {
+        yield_thread();
+        rcu_process_callbacks();
+    }
+}
+// Register [start, end) as a restartable region. If the thread running it is
+// preempted and another thread runs before it resumes, it continues at
+// abort_ip, so the region's final store either happened or never did.
+int uthread_rseq_register(void* start, void* end, void* abort_ip)
+{
+    if ((unsigned long)start >= (unsigned long)end || abort_ip == NULL) {
+        return -1;
+    }
+    lock();
+    if (num_rseq_regions >= MAX_RSEQ_REGIONS) {
+        unlock();
+        return -1;
+    }
+    rseq_regions[num_rseq_regions].start = (unsigned long)start;
+    rseq_regions[num_rseq_regions].end = (unsigned long)end;
+    rseq_regions[num_rseq_regions].abort_ip = (unsigned long)abort_ip;
+    num_rseq_regions++;
+    unlock();
+    return 0;
+}
+int uthread_rseq_unregister(void* start)
+{
+    lock();
+    for (int i = 0; i < num_rseq_regions; i++) {
+        if (rseq_regions[i].start == (unsigned long)start) {
+            for (int j = i; j < num_rseq_regions - 1; j++) {
+                rseq_regions[j] = rseq_regions[j + 1];
+            }
+            num_rseq_regions--;
+            unlock();
+            return 0;
+        }
+    }
+    unlock();
+    return -1;
+}
+// Epoch-based reclamation. Entering a region is a single store to the
+// caller's TCB; the thread's observed epoch only moves forward at quiescent
+// points (leaving the outermost region or being switched out outside one),
+// so a thread inside a region pins every epoch since its last such point.
+void uthread_ebr_enter(void)
+{
+    tcb_array[current_thread].ebr_nesting++;
+    asm volatile("" ::: "memory");
+}
+void uthread_ebr_exit(void)
+{
+    asm volatile("" ::: "memory");
+    TCB* tcb = &tcb_array[current_thread];
+    if (--tcb->ebr_nesting == 0) {
+        tcb->ebr_epoch = ebr_global_epoch;
+    }
+}
+// Run a reclaimed batch's free functions. Plain free is not preemption
+// safe, so runs of it are called with the signal blocked, like the
+// library's own allocations, sharing one mask change.
+static void ebr_free_batch(void** ptrs, void (**free_fns)(void*), int count)
+{
+    for (int i = 0; i < count; ) {
+        if (free_fns[i] != free) {
+            free_fns[i](ptrs[i]);
+            i++;
+            continue;
+        }
+        sigset_t old_set;
+        heap_block(&old_set);
+        for (; i < count && free_fns[i] == free; i++) {
+            free(ptrs[i]);
+        }
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
+    }
+}
+// Free everything in a limbo list retired at least two epochs ago
+static void ebr_reclaim_limbo(EbrLimbo* limbo)
+{
+    if (limbo->count == 0 || limbo->epoch + 2 > ebr_global_epoch) {
+        return;
+    }
+    ebr_free_batch(limbo->ptrs, limbo->free_fns, limbo->count);
+    limbo->count = 0;
+}
+static void ebr_try_advance()
+{
+    lock();
+    bool can_advance = true;
+    for (int i = 0; i < num_threads; i++) {
+        if (tcb_array[i].status != EXITED && tcb_array[i].ebr_nesting > 0 &&
+            tcb_array[i].ebr_epoch != ebr_global_epoch) {
+            can_advance = false;
+            break;
+        }
+    }
+    if (can_advance) {
+        ebr_global_epoch++;
+    }
+    unlock();
+
+    // Free outside lock(): free functions run in this thread's context
+    TCB* tcb = &tcb_array[current_thread];
+    for (int e = 0; e < 3; e++) {
+        ebr_reclaim_limbo(&tcb->ebr_limbo[e]);
+    }
+    // Exited threads can no longer do it themselves. Several threads may get
+    // here at once, so each list is detached with preemption disabled. Its
+    // free functions run after unlock(), as they may call into the library.
+    lock();
+    for (int i = 0; i < num_threads; i++) {
+        for (int e = 0; e < 3 && tcb_array[i].status == EXITED; e++) {
+            EbrLimbo* limbo = &tcb_array[i].ebr_limbo[e];
+            if (limbo->count == 0 || limbo->epoch + 2 > ebr_global_epoch) {
+                continue;
+            }
+            EbrLimbo detached = *limbo;
+            limbo->ptrs = NULL;
+            limbo->free_fns = NULL;
+            limbo->count = 0;
+            limbo->capacity = 0;
+            unlock();
+            ebr_free_batch(detached.ptrs, detached.free_fns, detached.count);
+            heap_free(detached.ptrs);
+            heap_free(detached.free_fns);
+            lock();
+        }
+    }
+    unlock();
+}
+int uthread_ebr_retire(void* ptr, void (*free_fn)(void*))
+{
+    if (free_fn == NULL) {
+        return -1;
+    }
+    TCB* tcb = &tcb_array[current_thread];
+    unsigned long epoch = ebr_global_epoch;
+    EbrLimbo* limbo = &tcb->ebr_limbo[epoch % 3];
+    if (limbo->epoch != epoch) {
+        // Slot last used three or more epochs ago: everything in it is safe
+        ebr_reclaim_limbo(limbo);
+        limbo->epoch = epoch;
+    }
+    if (limbo->count >= limbo->capacity) {
+        int new_capacity = (limbo->capacity == 0) ? 16 : limbo->capacity * 2;
+        void** new_ptrs = (void**)heap_realloc(limbo->ptrs, sizeof(void*) * new_capacity);
+        if (new_ptrs == NULL) {
+            return -1;
+        }
+        limbo->ptrs = new_ptrs;
+        void (**new_fns)(void*) = (void (**)(void*))heap_realloc(
+            limbo->free_fns, sizeof(limbo->free_fns[0]) * new_capacity);
+        if (new_fns == NULL) {
+            return -1;
+        }
+        limbo->free_fns = new_fns;
+        limbo->capacity = new_capacity;
+    }
+    limbo->ptrs[limbo->count] = ptr;
+    limbo->free_fns[limbo->count] = free_fn;
+    limbo->count++;
+    if (++tcb->ebr_retired >= EBR_BATCH) {
+        tcb->ebr_retired = 0;
+        ebr_try_advance();
+    }
+    return 0;
+}
+// Try to advance the epoch and free whatever has become safe
+void uthread_ebr_reclaim(void)
+{
+    tcb_array[current_thread].ebr_retired = 0;
+    ebr_try_advance();
+}
+// Sequence lock for small read-mostly data. Readers never write to the lock;
+// writers serialize on one of the library's semaphores, so a contended writer
+// blocks in the scheduler instead of spinning.
+struct uthread_seqlock {
+    unsigned int sequence;      // odd while a write is in progress
+    sem_t writer;
+};
+uthread_seqlock* uthread_seqlock_create(void)
+{
+    uthread_seqlock* seqlock = (uthread_seqlock*)heap_malloc(sizeof(uthread_seqlock));
+    if (seqlock == NULL) {
+        return NULL;
+    }
+    seqlock->sequence = 0;
+    if (sem_init(&seqlock->writer, 0, 1) != 0) {
+        heap_free(seqlock);
+        return NULL;
+    }
+    return seqlock;
+}
+int uthread_seqlock_destroy(uthread_seqlock* seqlock)
+{
+    if (sem_destroy(&seqlock->writer) != 0) {
+        return -1;
+    }
+    heap_free(seqlock);
+    return 0;
+}
+unsigned int uthread_seqlock_read_begin(uthread_seqlock* seqlock)
+{
+    unsigned int seq = __atomic_load_n(&seqlock->sequence, __ATOMIC_ACQUIRE);
+    // An odd value means the writer was preempted mid-update. Spinning would
+    // burn the rest of our slice, so let the writer run and finish instead.
+    while (seq & 1) {
+        yield_thread();
+        seq = __atomic_load_n(&seqlock->sequence, __ATOMIC_ACQUIRE);
+    }
+    return seq;
+}
+// Nonzero if a write overlapped the read started by read_begin
+int uthread_seqlock_read_retry(uthread_seqlock* seqlock, unsigned int start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&seqlock->sequence, __ATOMIC_RELAXED) != start;
+}
+int uthread_seqlock_write_lock(uthread_seqlock* seqlock)
+{
+    if (sem_wait(&seqlock->writer) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&seqlock->sequence, seqlock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 0;
+}
+int uthread_seqlock_write_unlock(uthread_seqlock* seqlock)
+{
+    __atomic_store_n(&seqlock->sequence, seqlock->sequence + 1, __ATOMIC_RELEASE);
+    return sem_post(&seqlock->writer);
+}
+// Eventcount: lets lock-free structures park threads without lost wakeups.
+// A waiter announces itself with prepare_wait, re-checks its condition, then
+// either cancels or commits. Notifiers only take lock() when someone has
+// announced, so the common uncontended notify is a single load.
+struct uthread_eventcount {
+    unsigned int epoch;         // bumped by every notify that finds waiters
+    int waiters;                // threads between prepare_wait and wakeup
+    int head;                   // parked threads, linked through TCB::ec_next
+    int tail;
+};
+static void ec_init(uthread_eventcount* ec)
+{
+    ec->epoch = 0;
+    ec->waiters = 0;
+    ec->head = -1;
+    ec->tail = -1;
+}
+uthread_eventcount* uthread_eventcount_create(void)
+{
+    uthread_eventcount* ec = (uthread_eventcount*)heap_malloc(sizeof(uthread_eventcount));
+    if (ec != NULL) {
+        ec_init(ec);
+    }
+    return ec;
+}
+int uthread_eventcount_destroy(uthread_eventcount* ec)
+{
+    if (ec->head != -1) {
+        return -1;              // threads still parked on it
+    }
+    heap_free(ec);
+    return 0;
+}
+unsigned int uthread_eventcount_prepare_wait(uthread_eventcount* ec)
+{
+    __atomic_fetch_add(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ec->epoch, __ATOMIC_SEQ_CST);
+}
+void uthread_eventcount_cancel_wait(uthread_eventcount* ec)
+{
+    __atomic_fetch_sub(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+void uthread_eventcount_commit_wait(uthread_eventcount* ec, unsigned int key)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    // A notify since prepare_wait means the condition may already hold
+    if (__atomic_load_n(&ec->epoch, __ATOMIC_SEQ_CST) == key) {
+        tcb_array[current_thread].ec_next = -1;
+        if (ec->tail == -1) {
+            ec->head = current_thread;
+        } else {
+            tcb_array[ec->tail].ec_next = current_thread;
+        }
+        ec->tail = current_thread;
+        tcb_array[current_thread].status = BLOCKED;
+        context_switch();
+    }
+    unlock();
+    __atomic_fetch_sub(&ec->waiters, 1, __ATOMIC_SEQ_CST);
+}
+// Wake up to max_wake parked threads (-1 for all). The epoch bump also
+// stops every thread between prepare_wait and commit_wait from sleeping.
+static void ec_notify(uthread_eventcount* ec, int max_wake)
+{
+    // Pairs with the fence in prepare_wait: either we see the waiter, or
+    // the waiter's re-check sees the state change that preceded this call
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ec->waiters, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    lock();
+    __atomic_fetch_add(&ec->epoch, 1, __ATOMIC_SEQ_CST);
+    while (ec->head != -1 && max_wake != 0) {
+        int t = ec->head;
+        ec->head = tcb_array[t].ec_next;
+        make_ready(t);
+        max_wake--;
+    }
+    if (ec->head == -1) {
+        ec->tail = -1;
+    }
+    unlock();
+}
+void uthread_eventcount_notify(uthread_eventcount* ec)
+{
+    ec_notify(ec, -1);
+}
+void uthread_eventcount_notify_one(uthread_eventcount* ec)
+{
+    ec_notify(ec, 1);
+}
+
+// Bounded lock-free queues of pointers. Producer and consumer indices live
+// on separate cache lines so the two sides don't false-share.
+struct uthread_spsc {
+    alignas(CACHE_LINE_SIZE) unsigned long head;    // next slot to pop
+    alignas(CACHE_LINE_SIZE) unsigned long tail;    // next slot to push
+    alignas(CACHE_LINE_SIZE) unsigned long mask;
+    void** slots;
+    uthread_eventcount not_empty;
+    uthread_eventcount not_full;
+};
+static unsigned long round_up_pow2(unsigned long n)
+{
+    unsigned long size = 2;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+uthread_spsc* uthread_spsc_create(unsigned long capacity)
+{
+    if (capacity == 0) {
+        return NULL;
+    }
+    uthread_spsc* q = (uthread_spsc*)heap_aligned_alloc(CACHE_LINE_SIZE, sizeof(uthread_spsc));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->mask = round_up_pow2(capacity) - 1;
+    q->slots = (void**)heap_malloc(sizeof(void*) * (q->mask + 1));
+    if (q->slots == NULL) {
+        heap_free(q);
+        return NULL;
+    }
+    q->head = 0;
+    q->tail = 0;
+    ec_init(&q->not_empty);
+    ec_init(&q->not_full);
+    return q;
+}
+void uthread_spsc_destroy(uthread_spsc* q)
+{
+    heap_free(q->slots);
+    heap_free(q);
+}
+// Non-blocking: push up to n items, returns how many were pushed
+int uthread_spsc_try_push_batch(uthread_spsc* q, void** items, int n)
+{
+    unsigned long tail = q->tail;
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    unsigned long space = q->mask + 1 - (tail - head);
+    int count = ((unsigned long)n < space) ? n : (int)space;
+    for (int i = 0; i < count; i++) {
+        q->slots[(tail + i) & q->mask] = items[i];
+    }
+    if (count > 0) {
+        __atomic_store_n(&q->tail, tail + count, __ATOMIC_RELEASE);
+        uthread_eventcount_notify(&q->not_empty);
+    }
+    return count;
+}
+// Non-blocking: pop up to max items, returns how many were popped
+int uthread_spsc_try_pop_batch(uthread_spsc* q, void** items, int max)
+{
+    unsigned long head = q->head;
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    unsigned long available = tail - head;
+    int count = ((unsigned long)max < available) ? max : (int)available;
+    for (int i = 0; i < count; i++) {
+        items[i] = q->slots[(head + i) & q->mask];
+    }
+    if (count > 0) {
+        __atomic_store_n(&q->head, head + count, __ATOMIC_RELEASE);
+        uthread_eventcount_notify(&q->not_full);
+    }
+    return count;
+}
+// Blocking: push all n items, parking while the queue is full
+void uthread_spsc_push_batch(uthread_spsc* q, void** items, int n)
+{
+    int done = 0;
+    while (done < n) {
+        int pushed = uthread_spsc_try_push_batch(q, items + done, n - done);
+        if (pushed > 0) {
+            done += pushed;
+            continue;
+        }
+        unsigned int key = uthread_eventcount_prepare_wait(&q->not_full);
+        pushed = uthread_spsc_try_push_batch(q, items + done, n - done);
+        if (pushed > 0) {
+            uthread_eventcount_cancel_wait(&q->not_full);
+            done += pushed;
+        } else {
+            uthread_eventcount_commit_wait(&q->not_full, key);
+        }
+    }
+}
+// Blocking: pop between 1 and max items, parking while the queue is empty
+int uthread_spsc_pop_batch(uthread_spsc* q, void** items, int max)
+{
+    for (;;) {
+        int popped = uthread_spsc_try_pop_batch(q, items, max);
+        if (popped > 0) {
+            return popped;
+        }
+        unsigned int key = uthread_eventcount_prepare_wait(&q->not_empty);
+        popped = uthread_spsc_try_pop_batch(q, items, max);
+        if (popped > 0) {
+            uthread_eventcount_cancel_wait(&q->not_empty);
+            return popped;
+        }
+        uthread_eventcount_commit_wait(&q->not_empty, key);
+    }
+}
+int uthread_spsc_try_push(uthread_spsc* q, void* item)
+{
+    return uthread_spsc_try_push_batch(q, &item, 1) == 1 ? 0 : -1;
+}
+int uthread_spsc_try_pop(uthread_spsc* q, void** item)
+{
+    return uthread_spsc_try_pop_batch(q, item, 1) == 1 ? 0 : -1;
+}
+void uthread_spsc_push(uthread_spsc* q, void* item)
+{
+    uthread_spsc_push_batch(q, &item, 1);
+}
+void* uthread_spsc_pop(uthread_spsc* q)
+{
+    void* item;
+    uthread_spsc_pop_batch(q, &item, 1);
+    return item;
+}
+
+// Vyukov's bounded MPMC queue: each cell's sequence number tells producers
+// and consumers whether it is free for their lap around the ring
+struct MpmcCell {
+    unsigned long sequence;
+    void* item;
+};
+struct uthread_mpmc {
+    alignas(CACHE_LINE_SIZE) unsigned long enqueue_pos;
+    alignas(CACHE_LINE_SIZE) unsigned long dequeue_pos;
+    alignas(CACHE_LINE_SIZE) unsigned long mask;
+    MpmcCell* cells;
+    uthread_eventcount not_empty;
+    uthread_eventcount not_full;
+};
+uthread_mpmc* uthread_mpmc_create(unsigned long capacity)
+{
+    if (capacity == 0) {
+        return NULL;
+    }
+    uthread_mpmc* q = (uthread_mpmc*)heap_aligned_alloc(CACHE_LINE_SIZE, sizeof(uthread_mpmc));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->mask = round_up_pow2(capacity) - 1;
+    q->cells = (MpmcCell*)heap_malloc(sizeof(MpmcCell) * (q->mask + 1));
+    if (q->cells == NULL) {
+        heap_free(q);
+        return NULL;
+    }
+    for (unsigned long i = 0; i <= q->mask; i++) {
+        q->cells[i].sequence = i;
+    }
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+    ec_init(&q->not_empty);
+    ec_init(&q->not_full);
+    return q;
+}
+void uthread_mpmc_destroy(uthread_mpmc* q)
+{
+    heap_free(q->cells);
+    heap_free(q);
+}
+static bool mpmc_enqueue(uthread_mpmc* q, void* item)
+{
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        MpmcCell* cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;       // full
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+static bool mpmc_dequeue(uthread_mpmc* q, void** item)
+{
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+        MpmcCell* cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *item = cell->item;
+                __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;       // empty
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+int uthread_mpmc_try_push_batch(uthread_mpmc* q, void** items, int n)
+{
+    int count = 0;
+    while (count < n && mpmc_enqueue(q, items[count])) {
+        count++;
+    }
+    if (count > 0) {
+        uthread_eventcount_notify(&q->not_empty);
+    }
+    return count;
+}
+int uthread_mpmc_try_pop_batch(uthread_mpmc* q, void** items, int max)
+{
+    int count = 0;
+    while (count < max && mpmc_dequeue(q, &items[count])) {
+        count++;
+    }
+    if (count > 0) {
+        uthread_eventcount_notify(&q->not_full);
+    }
+    return count;
+}
+void uthread_mpmc_push_batch(uthread_mpmc* q, void** items, int n)
+{
+    int done = 0;
+    while (done < n) {
+        int pushed = uthread_mpmc_try_push_batch(q, items + done, n - done);
+        if (pushed > 0) {
+            done += pushed;
+            continue;
+        }
+        unsigned int key = uthread_eventcount_prepare_wait(&q->not_full);
+        pushed = uthread_mpmc_try_push_batch(q, items + done, n - done);
+        if (pushed > 0) {
+            uthread_eventcount_cancel_wait(&q->not_full);
+            done += pushed;
+        } else {
+            uthread_eventcount_commit_wait(&q->not_full, key);
+        }
+    }
+}
+int uthread_mpmc_pop_batch(uthread_mpmc* q, void** items, int max)
+{
+    for (;;) {
+        int popped = uthread_mpmc_try_pop_batch(q, items, max);
+        if (popped > 0) {
+            return popped;
+        }
+        unsigned int key = uthread_eventcount_prepare_wait(&q->not_empty);
+        popped = uthread_mpmc_try_pop_batch(q, items, max);
+        if (popped > 0) {
+            uthread_eventcount_cancel_wait(&q->not_empty);
+            return popped;
+        }
+        uthread_eventcount_commit_wait(&q->not_empty, key);
+    }
+}
+int uthread_mpmc_try_push(uthread_mpmc* q, void* item)
+{
+    return uthread_mpmc_try_push_batch(q, &item, 1) == 1 ? 0 : -1;
+}
+int uthread_mpmc_try_pop(uthread_mpmc* q, void** item)
+{
+    return uthread_mpmc_try_pop_batch(q, item, 1) == 1 ? 0 : -1;
+}
+void uthread_mpmc_push(uthread_mpmc* q, void* item)
+{
+    uthread_mpmc_push_batch(q, &item, 1);
+}
+void* uthread_mpmc_pop(uthread_mpmc* q)
+{
+    void* item;
+    uthread_mpmc_pop_batch(q, &item, 1);
+    return item;
+}
+
+// Actor runtime. Each actor has a lock-free MPSC mailbox and is placed on the
+// shared run queue only when mail arrives while it is idle, so an actor with
+// nothing to do costs no thread and no wakeups. A fixed pool of daemon worker
+// threads pops runnable actors and handles up to actor_batch messages each.
+#define ACTOR_DEFAULT_WORKERS 4
+#define ACTOR_DEFAULT_BATCH 32
+#define ACTOR_DEFAULT_MAX_ACTORS (1UL << 17)
+#define ACTOR_IDLE 0
+#define ACTOR_SCHEDULED 1
+struct ActorMessage {
+    ActorMessage* next;
+    void* msg;
+    bool stop;
+};
+struct uthread_actor {
+    alignas(CACHE_LINE_SIZE) ActorMessage* mailbox_tail;     // producers
+    alignas(CACHE_LINE_SIZE) ActorMessage* mailbox_head;     // owning worker
+    int run_state;
+    void (*handler)(uthread_actor* self, void* state, void* msg);
+    void* state;
+};
+static uthread_mpmc* actor_run_queue = NULL;
+static int actor_batch = ACTOR_DEFAULT_BATCH;
+static unsigned long actor_capacity = 0;
+static unsigned long num_actors = 0;
+static void actor_schedule(uthread_actor* actor)
+{
+    int idle = ACTOR_IDLE;
+    if (__atomic_compare_exchange_n(&actor->run_state, &idle, ACTOR_SCHEDULED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // Never full: each live actor occupies at most one slot
+        uthread_mpmc_push(actor_run_queue, actor);
+    }
+}
+static ActorMessage* actor_mailbox_pop(uthread_actor* actor)
+{
+    ActorMessage* head = actor->mailbox_head;
+    ActorMessage* next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        return NULL;
+    }
+    // The popped node becomes the new stub; hand back the old one with the
+    // payload copied into it
+    actor->mailbox_head = next;
+    head->msg = next->msg;
+    head->stop = next->stop;
+    return head;
+}
+static void actor_free(void* ptr)
+{
+    uthread_actor* actor = (uthread_actor*)ptr;
+    heap_free(actor->mailbox_head);
+    heap_free(actor);
+}
+static void* actor_worker(void* arg)
+{
+    (void)arg;
+    for (;;) {
+        uthread_actor* actor = (uthread_actor*)uthread_mpmc_pop(actor_run_queue);
+        bool stopped = false;
+        ActorMessage* done = NULL;
+        for (int i = 0; i < actor_batch && !stopped; i++) {
+            ActorMessage* message = actor_mailbox_pop(actor);
+            if (message == NULL) {
+                break;
+            }
+            if (message->stop) {
+                stopped = true;
+            } else {
+                actor->handler(actor, actor->state, message->msg);
+            }
+            message->next = done;
+            done = message;
+        }
+        // Free the whole batch with one signal mask change
+        sigset_t old_set;
+        heap_block(&old_set);
+        while (done != NULL) {
+            ActorMessage* next = done->next;
+            free(done);
+            done = next;
+        }
+        sigprocmask(SIG_SETMASK, &old_set, NULL);
+        if (stopped) {
+            // run_state stays SCHEDULED so racing senders never requeue it.
+            // They may still be touching the actor, hence the deferred free.
+            uthread_ebr_retire(actor, actor_free);
+            __atomic_fetch_sub(&num_actors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_load_n(&actor->mailbox_head->next, __ATOMIC_ACQUIRE) != NULL) {
+            // Batch used up with mail left: go to the back of the run queue
+            uthread_mpmc_push(actor_run_queue, actor);
+            continue;
+        }
+        __atomic_store_n(&actor->run_state, ACTOR_IDLE, __ATOMIC_SEQ_CST);
+        // A sender that linked mail before seeing SCHEDULED relies on us
+        if (__atomic_load_n(&actor->mailbox_head->next, __ATOMIC_SEQ_CST) != NULL) {
+            actor_schedule(actor);
+        }
+    }
+    return NULL;
+}
+// Start the worker pool. Optional: the first uthread_actor_create starts it
+// with default settings.
+int uthread_actor_runtime_init(int workers, int batch, unsigned long max_actors)
+{
+    if (actor_run_queue != NULL || workers <= 0 || batch <= 0 || max_actors == 0) {
+        return -1;
+    }
+    uthread_mpmc* run_queue = uthread_mpmc_create(max_actors);
+    if (run_queue == NULL) {
+        return -1;
+    }
+    actor_run_queue = run_queue;
+    actor_batch = batch;
+    actor_capacity = max_actors;
+    pthread_t* ids = (pthread_t*)heap_malloc(sizeof(pthread_t) * workers);
+    if (ids == NULL || uthread_create_batch(workers, actor_worker, NULL, ids) != 0) {
+        heap_free(ids);
+        actor_run_queue = NULL;
+        uthread_mpmc_destroy(run_queue);
+        return -1;
+    }
+    lock();
+    for (int i = 0; i < workers; i++) {
+        tcb_array[(int)(long)ids[i]].daemon = true;
+    }
+    unlock();
+    heap_free(ids);
+    return 0;
+}
+uthread_actor* uthread_actor_create(void (*handler)(uthread_actor* self, void* state,
+                                                    void* msg),
+                                    void* state)
+{
+    if (actor_run_queue == NULL &&
+        uthread_actor_runtime_init(ACTOR_DEFAULT_WORKERS, ACTOR_DEFAULT_BATCH,
+                                   ACTOR_DEFAULT_MAX_ACTORS) != 0) {
+        return NULL;
+    }
+    if (__atomic_add_fetch(&num_actors, 1, __ATOMIC_RELAXED) > actor_capacity) {
+        __atomic_fetch_sub(&num_actors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uthread_actor* actor = (uthread_actor*)heap_aligned_alloc(CACHE_LINE_SIZE,
+                                                         sizeof(uthread_actor));
+    ActorMessage* stub = (ActorMessage*)heap_malloc(sizeof(ActorMessage));
+    if (actor == NULL || stub == NULL) {
+        heap_free(actor);
+        heap_free(stub);
+        __atomic_fetch_sub(&num_actors, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    stub->next = NULL;
+    actor->mailbox_head = stub;
+    actor->mailbox_tail = stub;
+    actor->run_state = ACTOR_IDLE;
+    actor->handler = handler;
+    actor->state = state;
+    return actor;
+}
+static int actor_post(uthread_actor* actor, void* msg, bool stop)
+{
+    ActorMessage* message = (ActorMessage*)heap_malloc(sizeof(ActorMessage));
+    if (message == NULL) {
+        return -1;
+    }
+    message->next = NULL;
+    message->msg = msg;
+    message->stop = stop;
+    // Once linked, a stop message lets a worker retire the actor while we
+    // are still scheduling it
+    uthread_ebr_enter();
+    ActorMessage* prev = __atomic_exchange_n(&actor->mailbox_tail, message,
+                                             __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, message, __ATOMIC_SEQ_CST);
+    actor_schedule(actor);
+    uthread_ebr_exit();
+    return 0;
+}
+int uthread_actor_send(uthread_actor* actor, void* msg)
+{
+    return actor_post(actor, msg, false);
+}
+// The actor handles the mail already queued, then is freed. No messages
+// may be sent to it afterwards.
+int uthread_actor_stop(uthread_actor* actor)
+{
+    return actor_post(actor, NULL, true);
+}
+
+// Pipelines: chains of stages, each run by a fixed number of worker threads
+// and fed by a bounded MPMC queue. Workers pop up to 'batch' items at a time
+// and forward their outputs as one batch, so wakeups are amortized across
+// items. A full downstream queue blocks the upstream workers (backpressure),
+// which is recorded in the downstream stage's statistics.
+#define PIPELINE_MAX_STAGES 16
+struct uthread_stage_stats {
+    unsigned long items;                // items handed to the stage function
+    unsigned long batches;              // input batches popped
+    unsigned long long service_ns;      // total time spent in the stage function
+    unsigned long long max_service_ns;  // slowest single item
+    unsigned long full_waits;           // pushes into this stage that had to block
+    unsigned long long full_wait_ns;    // time producers spent blocked on it
+    unsigned long queue_depth;          // items currently queued for the stage
+};
+struct PipelineStage {
+    void* (*fn)(void* item, void* ctx);
+    void* ctx;
+    int parallelism;
+    int batch;
+    uthread_mpmc* input;
+    unsigned long capacity;
+    unsigned long queued;               // items admitted to input, end markers excluded
+    uthread_eventcount room;            // notified when queued items are popped
+    int running;                        // workers that have not seen end of input
+    uthread_stage_stats stats;
+};
+struct uthread_pipeline {
+    PipelineStage stages[PIPELINE_MAX_STAGES];
+    int num_stages;
+    pthread_t* workers;
+    int num_workers;
+    bool started;
+    bool closed;                        // pipelines run once
+};
+// Queued after the last real item to shut the stage's workers down
+static char pipeline_end_marker;
+// Reserve room for up to n items within the stage's capacity. Returns how
+// many were admitted, 0 if the stage is full.
+static int pipeline_admit(PipelineStage* stage, int n)
+{
+    unsigned long queued = __atomic_load_n(&stage->queued, __ATOMIC_RELAXED);
+    for (;;) {
+        if (queued >= stage->capacity) {
+            return 0;
+        }
+        unsigned long room = stage->capacity - queued;
+        unsigned long admit = ((unsigned long)n < room) ? (unsigned long)n : room;
+        if (__atomic_compare_exchange_n(&stage->queued, &queued, queued + admit, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return (int)admit;
+        }
+    }
+}
+// Push items into a stage, blocking while it holds 'capacity' items. The
+// ring has extra room for the end markers, so admitted items never block.
+static void pipeline_push_batch(PipelineStage* stage, void** items, int n)
+{
+    int done = 0;
+    unsigned long long start = 0;
+    while (done < n) {
+        int admitted = pipeline_admit(stage, n - done);
+        if (admitted == 0) {
+            if (start == 0) {
+                start = monotonic_ns();
+            }
+            unsigned int key = uthread_eventcount_prepare_wait(&stage->room);
+            admitted = pipeline_admit(stage, n - done);
+            if (admitted == 0) {
+                uthread_eventcount_commit_wait(&stage->room, key);
+                continue;
+            }
+            uthread_eventcount_cancel_wait(&stage->room);
+        }
+        uthread_mpmc_push_batch(stage->input, items + done, admitted);
+        done += admitted;
+    }
+    if (start != 0) {
+        __atomic_fetch_add(&stage->stats.full_waits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stage->stats.full_wait_ns, monotonic_ns() - start,
+                           __ATOMIC_RELAXED);
+    }
+}
+// Allocated together with the worker's input and output batch buffers
+struct PipelineWorkerArg {
+    uthread_pipeline* pipeline;
+    int stage;
+    void** buffers;                     // points just past this struct
+};
+static void* pipeline_worker(void* arg)
+{
+    PipelineWorkerArg* worker = (PipelineWorkerArg*)arg;
+    uthread_pipeline* pipeline = worker->pipeline;
+    PipelineStage* stage = &pipeline->stages[worker->stage];
+    PipelineStage* next = (worker->stage + 1 < pipeline->num_stages) ? stage + 1 : NULL;
+    void** in = worker->buffers;
+    void** out = worker->buffers + stage->batch;
+    bool done = false;
+    while (!done) {
+        int n = uthread_mpmc_pop_batch(stage->input, in, stage->batch);
+        __atomic_fetch_add(&stage->stats.batches, 1, __ATOMIC_RELAXED);
+        // End markers come after every item, so only the ones before the
+        // first marker were admitted
+        int items = 0;
+        while (items < n && in[items] != &pipeline_end_marker) {
+            items++;
+        }
+        if (items > 0) {
+            __atomic_fetch_sub(&stage->queued, items, __ATOMIC_SEQ_CST);
+            uthread_eventcount_notify(&stage->room);
+        }
+        int produced = 0;
+        unsigned long long before = monotonic_ns();
+        for (int i = 0; i < n; i++) {
+            if (in[i] == &pipeline_end_marker) {
+                // Our share of the end markers; leave the rest for siblings
+                if (i + 1 < n) {
+                    uthread_mpmc_push_batch(stage->input, in + i + 1, n - i - 1);
+                }
+                done = true;
+                break;
+            }
+            void* result = stage->fn(in[i], stage->ctx);
+            unsigned long long after = monotonic_ns();
+            unsigned long long took = after - before;
+            before = after;
+            __atomic_fetch_add(&stage->stats.items, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stage->stats.service_ns, took, __ATOMIC_RELAXED);
+            unsigned long long max = __atomic_load_n(&stage->stats.max_service_ns,
+                                                     __ATOMIC_RELAXED);
+            while (took > max &&
+                   !__atomic_compare_exchange_n(&stage->stats.max_service_ns, &max, took,
+                                                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            if (result != NULL && next != NULL) {
+                out[produced++] = result;
+            }
+        }
+        if (produced > 0) {
+            pipeline_push_batch(next, out, produced);
+        }
+    }
+    // The last worker out passes end of input on to the next stage
+    if (__atomic_sub_fetch(&stage->running, 1, __ATOMIC_ACQ_REL) == 0 && next != NULL) {
+        for (int i = 0; i < next->parallelism; i++) {
+            uthread_mpmc_push(next->input, &pipeline_end_marker);
+        }
+    }
+    heap_free(worker);
+    return NULL;
+}
+uthread_pipeline* uthread_pipeline_create(void)
+{
+    uthread_pipeline* pipeline = (uthread_pipeline*)heap_calloc(1, sizeof(uthread_pipeline));
+    return pipeline;
+}
+// fn returns the item to pass downstream, or NULL to drop it. The last
+// stage's results are discarded.
+int uthread_pipeline_add_stage(uthread_pipeline* pipeline,
+                               void* (*fn)(void* item, void* ctx), void* ctx,
+                               int parallelism, unsigned long capacity, int batch)
+{
+    if (pipeline->started || pipeline->closed ||
+        pipeline->num_stages >= PIPELINE_MAX_STAGES ||
+        fn == NULL || parallelism <= 0 || capacity == 0 || batch <= 0) {
+        return -1;
+    }
+    PipelineStage* stage = &pipeline->stages[pipeline->num_stages];
+    // Room for the end markers on top of the requested capacity, which
+    // pipeline_push_batch enforces on its own
+    stage->input = uthread_mpmc_create(capacity + parallelism);
+    if (stage->input == NULL) {
+        return -1;
+    }
+    stage->fn = fn;
+    stage->ctx = ctx;
+    stage->parallelism = parallelism;
+    stage->batch = batch;
+    stage->capacity = capacity;
+    stage->queued = 0;
+    ec_init(&stage->room);
+    stage->running = parallelism;
+    memset(&stage->stats, 0, sizeof(stage->stats));
+    pipeline->num_stages++;
+    return 0;
+}
+int uthread_pipeline_start(uthread_pipeline* pipeline)
+{
+    if (pipeline->started || pipeline->closed || pipeline->num_stages == 0) {
+        return -1;
+    }
+    int total = 0;
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        total += pipeline->stages[i].parallelism;
+    }
+    pipeline->workers = (pthread_t*)heap_malloc(sizeof(pthread_t) * total);
+    void** args = (void**)heap_malloc(sizeof(void*) * total);
+    if (pipeline->workers == NULL || args == NULL) {
+        heap_free(pipeline->workers);
+        heap_free(args);
+        pipeline->workers = NULL;
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        for (int j = 0; j < pipeline->stages[i].parallelism; j++) {
+            PipelineWorkerArg* arg = (PipelineWorkerArg*)heap_malloc(
+                sizeof(PipelineWorkerArg) + 2 * sizeof(void*) * pipeline->stages[i].batch);
+            if (arg == NULL) {
+                break;
+            }
+            arg->pipeline = pipeline;
+            arg->stage = i;
+            arg->buffers = (void**)(arg + 1);
+            args[n++] = arg;
+        }
+    }
+    if (n != total || uthread_create_batch(total, pipeline_worker, args,
+                                           pipeline->workers) != 0) {
+        for (int i = 0; i < n; i++) {
+            heap_free(args[i]);
+        }
+        heap_free(args);
+        heap_free(pipeline->workers);
+        pipeline->workers = NULL;
+        return -1;
+    }
+    heap_free(args);
+    pipeline->num_workers = total;
+    pipeline->started = true;
+    return 0;
+}
+// Feed one item into the first stage, blocking while its queue is full
+int uthread_pipeline_push(uthread_pipeline* pipeline, void* item)
+{
+    if (!pipeline->started || item == NULL || item == &pipeline_end_marker) {
+        return -1;
+    }
+    pipeline_push_batch(&pipeline->stages[0], &item, 1);
+    return 0;
+}
+int uthread_pipeline_push_batch(uthread_pipeline* pipeline, void** items, int n)
+{
+    if (!pipeline->started || n < 0) {
+        return -1;
+    }
+    // Check the whole batch first so a bad item enqueues nothing
+    for (int i = 0; i < n; i++) {
+        if (items[i] == NULL || items[i] == &pipeline_end_marker) {
+            return -1;
+        }
+    }
+    pipeline_push_batch(&pipeline->stages[0], items, n);
+    return 0;
+}
+// End the input, wait until every stage has drained and join the workers
+int uthread_pipeline_close(uthread_pipeline* pipeline)
+{
+    if (!pipeline->started) {
+        return -1;
+    }
+    PipelineStage* first = &pipeline->stages[0];
+    for (int i = 0; i < first->parallelism; i++) {
+        uthread_mpmc_push(first->input, &pipeline_end_marker);
+    }
+    for (int i = 0; i < pipeline->num_workers; i++) {
+        pthread_join(pipeline->workers[i], NULL);
+    }
+    heap_free(pipeline->workers);
+    pipeline->workers = NULL;
+    pipeline->num_workers = 0;
+    pipeline->started = false;
+    pipeline->closed = true;
+    return 0;
+}
+int uthread_pipeline_stats(uthread_pipeline* pipeline, int stage,
+                           uthread_stage_stats* stats)
+{
+    if (stage < 0 || stage >= pipeline->num_stages) {
+        return -1;
+    }
+    PipelineStage* s = &pipeline->stages[stage];
+    *stats = s->stats;
+    stats->queue_depth = __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+    return 0;
+}
+int uthread_pipeline_destroy(uthread_pipeline* pipeline)
+{
+    if (pipeline->started) {
+        return -1;
+    }
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        uthread_mpmc_destroy(pipeline->stages[i].input);
+    }
+    heap_free(pipeline);
+    return 0;
+}
+
+// Register fd with the reactor on first use. Returns 1 if the fd can't be
+// polled (regular files and directories are always ready), -1 on error.
+static int register_fd(int fd)
+{
+    if (epoll_fd == -1) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            return -1;
+        }
+    }
+    if (fd >= fd_table_size) {
+        int new_size = (fd_table_size == 0) ? 64 : fd_table_size;
+        while (new_size <= fd) {
+            new_size *= 2;
+        }
+        FdState* table = (FdState*)heap_realloc(fd_table, sizeof(FdState) * new_size);
+        if (table == NULL) {
+            return -1;
+        }
+        for (int i = fd_table_size; i < new_size; i++) {
+            table[i].registered = false;
+            table[i].ready = 0;
+            table[i].waiters = -1;
+        }
+        fd_table = table;
+        fd_table_size = new_size;
+    }
+    if (fd_table[fd].registered) {
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLET;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        if (errno == EPERM) {
+            return 1;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    fd_table[fd].registered = true;
+    fd_table[fd].ready = 0;
+    return 0;
+}
+// Park the calling thread until fd reports one of the epoll events in
+// 'events' (EPOLLIN, EPOLLOUT, ...), or for at most timeout_ms milliseconds
+// (-1 waits forever). Returns the events that occurred, which may include
+// EPOLLERR and EPOLLHUP, 0 on timeout, or -1 on error. The fd should be
+// non-blocking and drained until EAGAIN before waiting: readiness is
+// edge-triggered, so a wakeup may be spurious but an edge is never lost.
+int uthread_wait_fd(int fd, unsigned int events, int timeout_ms)
+{
+    if (fd < 0 || events == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    int registered = register_fd(fd);
+    if (registered != 0) {
+        unlock();
+        return (registered == 1) ? (int)events : -1;
+    }
+    FdState* state = &fd_table[fd];
+    if ((state->ready & events) == 0 && timeout_ms == 0) {
+        poll_fd_events(0);
+    }
+    unsigned int sticky = EPOLLERR | EPOLLHUP;
+    unsigned int ready = state->ready & (events | sticky);
+    if (ready != 0 || timeout_ms == 0) {
+        // Consume the cached edge; errors and hangups stay until close
+        state->ready &= ~(events & ~sticky);
+        unlock();
+        return (int)ready;
+    }
+    TCB* tcb = &tcb_array[current_thread];
+    tcb->wait_fd = fd;
+    tcb->wait_events = events;
+    tcb->wait_revents = 0;
+    tcb->wait_deadline_ns = 0;
+    if (timeout_ms > 0) {
+        set_deadline(current_thread,
+                     clock_now_ns() + (unsigned long long)timeout_ms * 1000000ULL);
+    }
+    tcb->fd_next = state->waiters;
+    state->waiters = current_thread;
+    num_fd_waiters++;
+    tcb->status = BLOCKED;
+    context_switch();
+    ready = tcb->wait_revents;
+    unlock();
+    return (int)ready;
+}
+// Close an fd used with uthread_wait_fd. The reactor caches per-fd state,
+// so such fds must be closed here rather than with close(). Threads still
+// parked on the fd are woken with EPOLLHUP.
+int uthread_close(int fd)
+{
+    if (initialized) {
+        lock();
+        if (fd >= 0 && fd < fd_table_size && fd_table[fd].registered) {
+            while (fd_table[fd].waiters != -1) {
+                wake_fd_waiter(fd_table[fd].waiters, EPOLLHUP);
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            fd_table[fd].registered = false;
+            fd_table[fd].ready = 0;
+        }
+        unlock();
+    }
+    return close(fd);
+}
+
+// Buffer pool: fixed-size slabs in one page-aligned mapping, handed between
+// threads by pointer so payloads are never copied. Each handle carries a
+// reference count. Each thread keeps a small private cache of free slabs, so
+// an alloc/release pair normally needs no lock(). Only refills and flushes
+// touch the shared free list.
+struct uthread_buffer_pool;
+struct uthread_buffer {
+    uthread_buffer_pool* pool;
+    void* data;
+    size_t length;              // bytes of valid payload, set by the producer
+    int refs;
+    unsigned int index;         // slab number, also the registered buffer index
+};
+struct PoolCache {
+    int count;
+    unsigned int slots[POOL_CACHE_SIZE];
+};
+struct uthread_buffer_pool {
+    size_t slab_size;
+    unsigned int num_slabs;
+    char* memory;
+    size_t mapped_size;
+    uthread_buffer* buffers;
+    struct iovec* iovecs;
+    unsigned int* free_slots;   // shared free list, guarded by lock()
+    unsigned int free_count;
+    PoolCache caches[MAX_THREADS];
+};
+uthread_buffer_pool* uthread_buffer_pool_create(size_t slab_size, unsigned int count)
+{
+    if (slab_size == 0 || count == 0) {
+        return NULL;
+    }
+    uthread_buffer_pool* pool = (uthread_buffer_pool*)heap_calloc(1, sizeof(uthread_buffer_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    // Keep every slab cache-line aligned so neighbours never false-share
+    pool->slab_size = (slab_size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    pool->num_slabs = count;
+    pool->mapped_size = pool->slab_size * count;
+    pool->memory = (char*)mmap(NULL, pool->mapped_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    pool->buffers = (uthread_buffer*)heap_malloc(sizeof(uthread_buffer) * count);
+    pool->iovecs = (struct iovec*)heap_malloc(sizeof(struct iovec) * count);
+    pool->free_slots = (unsigned int*)heap_malloc(sizeof(unsigned int) * count);
+    if (pool->memory == MAP_FAILED || pool->buffers == NULL ||
+        pool->iovecs == NULL || pool->free_slots == NULL) {
+        if (pool->memory != MAP_FAILED) {
+            munmap(pool->memory, pool->mapped_size);
+        }
+        heap_free(pool->buffers);
+        heap_free(pool->iovecs);
+        heap_free(pool->free_slots);
+        heap_free(pool);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        uthread_buffer* buf = &pool->buffers[i];
+        buf->pool = pool;
+        buf->data = pool->memory + (size_t)i * pool->slab_size;
+        buf->length = 0;
+        buf->refs = 0;
+        buf->index = i;
+        pool->iovecs[i].iov_base = buf->data;
+        pool->iovecs[i].iov_len = pool->slab_size;
+        // Hand out low slabs first
+        pool->free_slots[i] = count - 1 - i;
+    }
+    pool->free_count = count;
+    return pool;
+}
+// Fails while any buffer is still referenced
+int uthread_buffer_pool_destroy(uthread_buffer_pool* pool)
+{
+    for (unsigned int i = 0; i < pool->num_slabs; i++) {
+        if (__atomic_load_n(&pool->buffers[i].refs, __ATOMIC_ACQUIRE) != 0) {
+            return -1;
+        }
+    }
+    munmap(pool->memory, pool->mapped_size);
+    heap_free(pool->buffers);
+    heap_free(pool->iovecs);
+    heap_free(pool->free_slots);
+    heap_free(pool);
+    return 0;
+}
+// Move free slabs from the shared list into the caller's cache. When the
+// list is empty, take back the caches of threads that have exited.
+static void pool_refill(uthread_buffer_pool* pool, PoolCache* cache)
+{
+    lock();
+    if (pool->free_count == 0) {
+        for (int i = 0; i < num_threads; i++) {
+            PoolCache* other = &pool->caches[i];
+            if (tcb_array[i].status == EXITED && other->count > 0) {
+                memcpy(&pool->free_slots[pool->free_count], other->slots,
+                       sizeof(unsigned int) * other->count);
+                pool->free_count += other->count;
+                other->count = 0;
+            }
+        }
+    }
+    while (cache->count < POOL_CACHE_SIZE / 2 && pool->free_count > 0) {
+        cache->slots[cache->count++] = pool->free_slots[--pool->free_count];
+    }
+    unlock();
+}
+// Returns a buffer with one reference and length 0, or NULL if the pool is
+// exhausted
+uthread_buffer* uthread_buffer_alloc(uthread_buffer_pool* pool)
+{
+    // Only the owning thread touches its cache, so preemption is harmless
+    PoolCache* cache = &pool->caches[current_thread];
+    if (cache->count == 0) {
+        pool_refill(pool, cache);
+        if (cache->count == 0) {
+            return NULL;
+        }
+    }
+    uthread_buffer* buf = &pool->buffers[cache->slots[--cache->count]];
+    buf->length = 0;
+    __atomic_store_n(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+// Take an extra reference, e.g. before handing the buffer to a second consumer
+void uthread_buffer_ref(uthread_buffer* buf)
+{
+    __atomic_fetch_add(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+// Drop a reference; the last one returns the slab to the caller's cache
+void uthread_buffer_release(uthread_buffer* buf)
+{
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    uthread_buffer_pool* pool = buf->pool;
+    PoolCache* cache = &pool->caches[current_thread];
+    if (cache->count == POOL_CACHE_SIZE) {
+        // Flush half so a thread that only releases doesn't hoard slabs
+        lock();
+        int keep = POOL_CACHE_SIZE / 2;
+        memcpy(&pool->free_slots[pool->free_count], &cache->slots[keep],
+               sizeof(unsigned int) * (POOL_CACHE_SIZE - keep));
+        pool->free_count += POOL_CACHE_SIZE - keep;
+        cache->count = keep;
+        unlock();
+    }
+    cache->slots[cache->count++] = buf->index;
+}
+void* uthread_buffer_data(uthread_buffer* buf)
+{
+    return buf->data;
+}
+size_t uthread_buffer_capacity(uthread_buffer* buf)
+{
+    return buf->pool->slab_size;
+}
+size_t uthread_buffer_length(uthread_buffer* buf)
+{
+    return buf->length;
+}
+int uthread_buffer_set_length(uthread_buffer* buf, size_t length)
+{
+    if (length > buf->pool->slab_size) {
+        return -1;
+    }
+    buf->length = length;
+    return 0;
+}
+// Slab index, matching the position of its iovec below
+unsigned int uthread_buffer_index(uthread_buffer* buf)
+{
+    return buf->index;
+}
+// One iovec per slab, for registering the pool with io_uring_register_buffers
+// so the kernel can read and write the slabs directly (READ_FIXED/WRITE_FIXED
+// with buf_index = uthread_buffer_index)
+const struct iovec* uthread_buffer_pool_iovecs(uthread_buffer_pool* pool,
+                                               unsigned int* count)
+{
+    *count = pool->num_slabs;
+    return pool->iovecs;
+}
+
+// Move count bytes from the calling thread's splice pipe to fd_out, parking
+// while fd_out is full
+static int drain_splice_pipe(int pipe_out, int fd_out, size_t count)
+{
+    while (count > 0) {
+        ssize_t n = splice(pipe_out, NULL, fd_out, NULL, count,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            count -= n;
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            if (uthread_wait_fd(fd_out, EPOLLOUT, -1) != -1) {
+                continue;
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+// Zero-copy transfer of up to len bytes from fd_in to fd_out through a
+// per-thread pipe, so the data never passes through user memory. Parks until
+// fd_in has data, then moves what is available. Returns the number of bytes
+// moved, 0 at end of input, or -1 on error.
+ssize_t uthread_splice(int fd_in, int fd_out, size_t len)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    TCB* tcb = &tcb_array[current_thread];
+    if (tcb->splice_pipe[0] == -1) {
+        if (pipe2(tcb->splice_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            tcb->splice_pipe[0] = -1;
+            tcb->splice_pipe[1] = -1;
+            return -1;
+        }
+    }
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = splice(fd_in, NULL, tcb->splice_pipe[1], NULL, len - total,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            if (drain_splice_pipe(tcb->splice_pipe[0], fd_out, n) == -1) {
+                // Bytes may be stranded in the pipe; start the next call afresh
+                int saved_errno = errno;
+                close_splice_pipe(tcb);
+                errno = saved_errno;
+                return -1;
+            }
+            total += n;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (errno != EAGAIN || total > 0) {
+            // EAGAIN after some progress just means fd_in is drained for now
+            return (total > 0) ? (ssize_t)total : -1;
+        }
+        if (uthread_wait_fd(fd_in, EPOLLIN | EPOLLRDHUP, -1) == -1) {
+            return -1;
+        }
+    }
+    return (ssize_t)total;
+}
+// sendfile() to a non-blocking socket, parking while the socket is full.
+// Sends all count bytes unless in_fd reaches end of file or an error occurs.
+ssize_t uthread_sendfile(int out_fd, int in_fd, off_t* offset, size_t count)
+{
+    size_t total = 0;
+    while (total < count) {
+        ssize_t n = sendfile(out_fd, in_fd, offset, count - total);
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (errno != EAGAIN || uthread_wait_fd(out_fd, EPOLLOUT, -1) == -1) {
+            return (total > 0) ? (ssize_t)total : -1;
+        }
+    }
+    return (ssize_t)total;
+}
+
+// Current time in nanoseconds on the clock used by sleeps and timeouts
+unsigned long long uthread_now_ns(void)
+{
+    return clock_now_ns();
+}
+// Block the calling thread until uthread_now_ns() reaches deadline_ns.
+// Sleeping to absolute times keeps periodic loops from drifting.
+int uthread_sleep_until(unsigned long long deadline_ns)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    if (deadline_ns > clock_now_ns()) {
+        set_deadline(current_thread, deadline_ns);
+        tcb_array[current_thread].status = BLOCKED;
+        context_switch();
+    }
+    unlock();
+    return 0;
+}
+// Block the calling thread for ns nanoseconds; 0 just yields
+int uthread_sleep_ns(unsigned long long ns)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    if (ns == 0) {
+        yield_thread();
+        return 0;
+    }
+    return uthread_sleep_until(clock_now_ns() + ns);
+}
+// Switch to a simulated clock for discrete-event tests. Time starts at the
+// current CLOCK_MONOTONIC value and then only advances when every thread is
+// blocked, straight to the nearest deadline. Preemption is turned off so runs
+// are deterministic: threads switch only when they block or yield. Must be
+// called before any thread waits on a deadline; there is no way back.
+int uthread_enable_virtual_time(void)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    if (num_timed_waiters > 0) {
+        unlock();
+        return -1;
+    }
+    if (!virtual_time) {
+        virtual_now_ns = monotonic_ns();
+        virtual_time = true;
+        struct itimerspec timer;
+        memset(&timer, 0, sizeof(timer));
+        timer_settime(preempt_timer, 0, &timer, NULL);
+        next_tick_ns = 0;
+    }
+    unlock();
+    return 0;
+}
+
+// Callback timers. Armed timers sit in a hierarchical timer wheel: level L
+// holds timers due within 64^(L+1) ticks, so arming and cancelling only
+// link or unlink a node. A daemon timer thread advances the wheel, moving
+// timers down a level as their time approaches, and runs each tick's
+// expired callbacks as one batch on its own stack. It sleeps on the
+// scheduler's deadline until the next occupied slot, so it follows the
+// virtual clock too.
+struct uthread_timer {
+    void (*callback)(void*);
+    void* arg;
+    unsigned long long deadline_ns;     // ideal expiry; periods advance from it
+    unsigned long long period_ns;       // 0 for one-shot
+    unsigned long long slack_ns;        // expiry may be rounded up by this much
+    unsigned long long expires_tick;
+    uthread_timer* next;                // wheel slot list
+    uthread_timer** pprev;              // NULL when not in the wheel
+    int level;
+    uthread_timer* fire_next;           // batch being run by the timer thread
+    bool firing;                        // in that batch, callback still pending
+    bool in_batch;
+    bool destroyed;                     // free once the batch is done with it
+};
+static void timer_wheel_insert(uthread_timer* timer)
+{
+    unsigned long long expires = timer->expires_tick;
+    if (expires < timer_wheel_tick) {
+        expires = timer_wheel_tick;
+    }
+    unsigned long long delta = expires - timer_wheel_tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    unsigned long long range = 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= range) {
+        // Beyond the wheel: park in the furthest top-level slot for now
+        expires = timer_wheel_tick + range - 1;
+    }
+    int slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    uthread_timer** head = &timer_wheel[level][slot];
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->level = level;
+    timer_wheel_count[level]++;
+}
+static void timer_wheel_remove(uthread_timer* timer)
+{
+    if (timer->pprev == NULL) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+    timer->next = NULL;
+    timer_wheel_count[timer->level]--;
+}
+// Compute the wheel slot time, applying slack so that nearby timers share
+// a tick and fire in the same batch
+static void timer_set_expiry(uthread_timer* timer)
+{
+    unsigned long long fire_ns = timer->deadline_ns;
+    if (timer->slack_ns > 0) {
+        fire_ns = (fire_ns + timer->slack_ns - 1) / timer->slack_ns * timer->slack_ns;
+    }
+    timer->expires_tick = (fire_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+}
+// Earliest tick at which the wheel has work: an occupied level-0 slot, or
+// the moment an occupied higher slot cascades. 0 when the wheel is empty.
+static unsigned long long timer_wheel_next_tick()
+{
+    unsigned long long best = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (timer_wheel_count[level] == 0) {
+            continue;
+        }
+        int shift = TIMER_WHEEL_BITS * level;
+        unsigned long long base = timer_wheel_tick >> shift;
+        // The current level-0 slot is still pending; higher ones have cascaded
+        for (int k = (level == 0) ? 0 : 1; k <= TIMER_WHEEL_SLOTS; k++) {
+            int slot = (base + k) & (TIMER_WHEEL_SLOTS - 1);
+            if (timer_wheel[level][slot] != NULL) {
+                unsigned long long tick = (base + k) << shift;
+                if (best == 0 || tick < best) {
+                    best = tick;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+// Advance the wheel to the current time, returning the expired timers as a
+// batch. Periodic timers are re-armed here, one period after their previous
+// ideal expiry, so they don't drift; missed periods are skipped.
+static uthread_timer* timer_wheel_advance()
+{
+    unsigned long long now = clock_now_ns();
+    unsigned long long now_tick = now / TIMER_TICK_NS;
+    uthread_timer* batch = NULL;
+    uthread_timer** batch_tail = &batch;
+    while (timer_wheel_tick <= now_tick) {
+        int index = timer_wheel_tick & (TIMER_WHEEL_SLOTS - 1);
+        // Move timers down from every level whose slot boundary this is
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int shift = TIMER_WHEEL_BITS * level;
+            if ((timer_wheel_tick & ((1ULL << shift) - 1)) != 0) {
+                break;
+            }
+            int slot = (timer_wheel_tick >> shift) & (TIMER_WHEEL_SLOTS - 1);
+            uthread_timer* list = timer_wheel[level][slot];
+            timer_wheel[level][slot] = NULL;
+            while (list != NULL) {
+                uthread_timer* next = list->next;
+                list->pprev = NULL;
+                timer_wheel_count[level]--;
+                timer_wheel_insert(list);
+                list = next;
+            }
+        }
+        while (timer_wheel[0][index] != NULL) {
+            uthread_timer* timer = timer_wheel[0][index];
+            timer_wheel_remove(timer);
+            if (!timer->in_batch) {
+                timer->in_batch = true;
+                timer->fire_next = NULL;
+                *batch_tail = timer;
+                batch_tail = &timer->fire_next;
+            }
+            timer->firing = true;
+            if (timer->period_ns > 0) {
+                timer->deadline_ns += timer->period_ns;
+                if (timer->deadline_ns <= now) {
+                    unsigned long long missed = (now - timer->deadline_ns) / timer->period_ns + 1;
+                    timer->deadline_ns += missed * timer->period_ns;
+                }
+                timer_set_expiry(timer);
+                timer_wheel_insert(timer);
+            }
+        }
+        timer_wheel_tick++;
+        // Skip ahead over the empty rest of a level-0 rotation
+        if (timer_wheel_count[0] == 0 && timer_wheel_tick <= now_tick) {
+            unsigned long long boundary = (timer_wheel_tick | (TIMER_WHEEL_SLOTS - 1)) + 1;
+            timer_wheel_tick = (boundary < now_tick + 1) ? boundary : now_tick + 1;
+            if ((timer_wheel_tick & (TIMER_WHEEL_SLOTS - 1)) != 0) {
+                break;
+            }
+        }
+    }
+    return batch;
+}
+// Pull the timer thread's wakeup forward if a new timer is due sooner
+static void timer_thread_kick(uthread_timer* timer)
+{
+    if (!timer_thread_parked) {
+        return;
+    }
+    unsigned long long wake_ns = timer->expires_tick * TIMER_TICK_NS;
+    if (wake_ns == 0) {
+        wake_ns = 1;
+    }
+    if (tcb_array[timer_thread].wait_deadline_ns == 0) {
+        set_deadline(timer_thread, wake_ns);
+    } else if (wake_ns < tcb_array[timer_thread].wait_deadline_ns) {
+        tcb_array[timer_thread].wait_deadline_ns = wake_ns;
+        preempt_by(wake_ns);
+    }
+}
+static void* timer_thread_main(void* arg)
+{
+    (void)arg;
+    lock();
+    for (;;) {
+        uthread_timer* batch = timer_wheel_advance();
+        if (batch == NULL) {
+            unsigned long long next = timer_wheel_next_tick();
+            timer_thread_parked = true;
+            if (next != 0) {
+                set_deadline(current_thread, next * TIMER_TICK_NS);
+            }
+            tcb_array[current_thread].status = BLOCKED;
+            context_switch();
+            timer_thread_parked = false;
+            continue;
+        }
+        while (batch != NULL) {
+            uthread_timer* timer = batch;
+            batch = timer->fire_next;
+            if (timer->firing && !timer->destroyed) {
+                timer->firing = false;
+                // Callbacks run preemptible, like any other thread code
+                unlock();
+                timer->callback(timer->arg);
+                lock();
+            }
+            timer->in_batch = false;
+            if (timer->destroyed) {
+                heap_free(timer);
+            }
+        }
+    }
+    return NULL;
+}
+uthread_timer* uthread_timer_create(void (*callback)(void*), void* arg)
+{
+    if (callback == NULL) {
+        return NULL;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+    uthread_timer* timer = (uthread_timer*)heap_calloc(1, sizeof(uthread_timer));
+    if (timer == NULL) {
+        return NULL;
+    }
+    timer->callback = callback;
+    timer->arg = arg;
+    lock();
+    if (timer_thread == -1) {
+        pthread_t id;
+        timer_thread = -2;
+        timer_wheel_tick = clock_now_ns() / TIMER_TICK_NS;
+        unlock();
+        if (pthread_create(&id, NULL, timer_thread_main, NULL) != 0) {
+            timer_thread = -1;
+            heap_free(timer);
+            return NULL;
+        }
+        lock();
+        timer_thread = (int)(long)id;
+        tcb_array[timer_thread].daemon = true;
+    }
+    unlock();
+    return timer;
+}
+// Arm (or re-arm) the timer to fire after delay_ns and then every period_ns
+// (0 for one-shot), measured on the clock behind uthread_now_ns
+int uthread_timer_start(uthread_timer* timer, unsigned long long delay_ns,
+                        unsigned long long period_ns)
+{
+    if (timer->destroyed) {
+        return -1;
+    }
+    lock();
+    timer_wheel_remove(timer);
+    unsigned long long now = clock_now_ns();
+    bool empty = true;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        empty = empty && timer_wheel_count[level] == 0;
+    }
+    if (empty && timer_wheel_tick < now / TIMER_TICK_NS) {
+        // Nothing to catch up on after an idle spell
+        timer_wheel_tick = now / TIMER_TICK_NS;
+    }
+    timer->deadline_ns = now + delay_ns;
+    timer->period_ns = period_ns;
+    timer->firing = false;
+    timer_set_expiry(timer);
+    timer_wheel_insert(timer);
+    timer_thread_kick(timer);
+    unlock();
+    return 0;
+}
+// Disarm the timer; a callback that hasn't started yet won't run
+int uthread_timer_cancel(uthread_timer* timer)
+{
+    if (timer->destroyed) {
+        return -1;
+    }
+    lock();
+    timer_wheel_remove(timer);
+    timer->firing = false;
+    unlock();
+    return 0;
+}
+// Let the timer fire up to slack_ns late so it can share a wakeup with
+// timers that expire close to it
+int uthread_timer_set_slack(uthread_timer* timer, unsigned long long slack_ns)
+{
+    if (timer->destroyed) {
+        return -1;
+    }
+    lock();
+    timer->slack_ns = slack_ns;
+    unlock();
+    return 0;
+}
+int uthread_timer_destroy(uthread_timer* timer)
+{
+    if (timer->destroyed) {
+        return -1;
+    }
+    lock();
+    timer_wheel_remove(timer);
+    timer->destroyed = true;
+    // The timer thread still holds it in a batch; it frees it when done
+    bool deferred = timer->in_batch;
+    unlock();
+    if (!deferred) {
+        heap_free(timer);
+    }
+    return 0;
+}
+
+// Sleeps park only the calling green thread. Sleeps on the monotonic and
+// realtime clocks become scheduler deadlines (absolute ones included); CPU
+// time clocks fall through to the kernel. Returns an error number, like
+// the call it replaces.
+int clock_nanosleep(clockid_t clock_id, int flags, const struct timespec* request,
+                    struct timespec* remain)
+{
+    if (request->tv_nsec < 0 || request->tv_nsec >= 1000000000L || request->tv_sec < 0) {
+        return EINVAL;
+    }
+    if (!initialized || (clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_REALTIME)) {
+        if (syscall(SYS_clock_nanosleep, clock_id, flags, request, remain) == -1) {
+            return errno;
+        }
+        return 0;
+    }
+    long long request_ns = (long long)request->tv_sec * 1000000000LL + request->tv_nsec;
+    unsigned long long now = clock_now_ns();
+    long long delay_ns = request_ns;
+    if (flags & TIMER_ABSTIME) {
+        // Our clock is CLOCK_MONOTONIC (or virtual time started from it)
+        long long clock_ns = (long long)now;
+        if (clock_id == CLOCK_REALTIME) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            clock_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        }
+        delay_ns = request_ns - clock_ns;
+    }
+    if (delay_ns > 0) {
+        uthread_sleep_until(now + delay_ns);
+    }
+    return 0;
+}
+int nanosleep(const struct timespec* request, struct timespec* remain)
+{
+    int error = clock_nanosleep(CLOCK_MONOTONIC, 0, request, remain);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Periodic release for sampling loops: each wait sleeps until the next
+// release time, which advances by exactly one period, so jitter in one
+// iteration never accumulates.
+struct uthread_periodic {
+    unsigned long long next_ns;
+    unsigned long long period_ns;
+    unsigned long releases;     // waits that returned at a release time
+    unsigned long overruns;     // releases skipped because an iteration ran late
+};
+// The first release is one period from now
+uthread_periodic* uthread_periodic_create(unsigned long long period_ns)
+{
+    if (period_ns == 0) {
+        return NULL;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+    uthread_periodic* periodic = (uthread_periodic*)heap_malloc(sizeof(uthread_periodic));
+    if (periodic == NULL) {
+        return NULL;
+    }
+    periodic->period_ns = period_ns;
+    periodic->next_ns = clock_now_ns() + period_ns;
+    periodic->releases = 0;
+    periodic->overruns = 0;
+    return periodic;
+}
+// Sleep until the next release. If the caller overran and releases have
+// already passed, they are skipped rather than run back to back; returns
+// how many were skipped this time.
+int uthread_periodic_wait(uthread_periodic* periodic)
+{
+    unsigned long long now = clock_now_ns();
+    unsigned long long missed = 0;
+    if (now > periodic->next_ns) {
+        missed = (now - periodic->next_ns) / periodic->period_ns;
+        periodic->next_ns += missed * periodic->period_ns;
+        periodic->overruns += missed;
+    }
+    uthread_sleep_until(periodic->next_ns);
+    periodic->next_ns += periodic->period_ns;
+    periodic->releases++;
+    return (missed > INT_MAX) ? INT_MAX : (int)missed;
+}
+unsigned long uthread_periodic_releases(uthread_periodic* periodic)
+{
+    return periodic->releases;
+}
+unsigned long uthread_periodic_overruns(uthread_periodic* periodic)
+{
+    return periodic->overruns;
+}
+int uthread_periodic_destroy(uthread_periodic* periodic)
+{
+    heap_free(periodic);
+    return 0;
+}
+
+// Per-thread CPU hog statistics
+struct uthread_hog_stats {
+    unsigned long full_slices;          // preemptions after using a whole slice
+    unsigned long streak;               // slices run since it last blocked or yielded
+    unsigned long max_streak;
+    unsigned long slice_flags;          // times the streak reached the limit
+    unsigned long long max_lock_ns;     // longest preemption-disabled stretch seen
+    unsigned long lock_flags;           // stretches over the lock limit
+    bool background;                    // in the background class (set or demoted)
+};
+// Flag a thread once it has run for slice_limit slices without blocking
+// or yielding, or when a tick arrives lock_limit_ns late because the thread
+// kept preemption disabled. 0 disables either check. The callback, if any,
+// runs on the flagged thread when it is next scheduled, with preemption
+// disabled; it must not block. With demote set, a slice hog is moved to
+// the background class until it next blocks or yields.
+int uthread_hog_configure(unsigned long slice_limit, unsigned long long lock_limit_ns,
+                          void (*callback)(pthread_t thread, int reason,
+                                           unsigned long long amount),
+                          bool demote)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    hog_slice_limit = slice_limit;
+    hog_lock_limit_ns = lock_limit_ns;
+    hog_callback = callback;
+    hog_demote = demote;
+    unlock();
+    return 0;
+}
+int uthread_get_hog_stats(pthread_t thread, uthread_hog_stats* stats)
+{
+    int index = (int)(long)thread;
+    if (!initialized || index < 0 || index >= num_threads ||
+        tcb_array[index].has_been_joined) {
+        return -1;
+    }
+    lock();
+    TCB* tcb = &tcb_array[index];
+    stats->full_slices = tcb->full_slices;
+    stats->streak = tcb->hog_streak;
+    stats->max_streak = tcb->hog_max_streak;
+    stats->slice_flags = tcb->hog_slice_flags;
+    stats->max_lock_ns = tcb->max_lock_ns;
+    stats->lock_flags = tcb->hog_lock_flags;
+    stats->background = tcb->background || tcb->demoted;
+    unlock();
+    return 0;
+}
+// Put a thread in (or take it out of) the background class, which only
+// runs when no other thread is ready
+int uthread_set_background(pthread_t thread, bool background)
+{
+    int index = (int)(long)thread;
+    if (!initialized || index < 0 || index >= num_threads ||
+        tcb_array[index].status == EXITED) {
+        return -1;
+    }
+    lock();
+    tcb_array[index].background = background;
+    unlock();
+    return 0;
+}
+
+// Choose between round robin (the default) and stride scheduling, which
+// splits CPU time between ready threads in proportion to their tickets
+int uthread_set_sched_policy(int policy)
+{
+    if (policy != UTHREAD_SCHED_ROUND_ROBIN && policy != UTHREAD_SCHED_STRIDE) {
+        return -1;
+    }
+    if (!initialized) {
+        init_threading();
+    }
+    lock();
+    if (policy != sched_policy) {
+        sched_policy = policy;
+        stride_heap_size = 0;
+        for (int i = 0; i < num_threads; i++) {
+            tcb_array[i].heap_index = -1;
+        }
+        if (policy == UTHREAD_SCHED_STRIDE) {
+            // Everyone starts level; the running thread rejoins in schedule()
+            for (int i = 0; i < num_threads; i++) {
+                tcb_array[i].pass = stride_global_pass;
+                if (tcb_array[i].status == READY && !thread_throttled(i)) {
+                    stride_heap_push(i);
+                }
+            }
+        }
+    }
+    unlock();
+    return 0;
+}
+// Set a thread's share of the CPU under stride scheduling; takes effect
+// from its next slice. Tickets are relative: threads with 70, 20 and 10
+// tickets get 70%, 20% and 10% while all of them stay runnable.
+int uthread_set_tickets(pthread_t thread, unsigned int tickets)
+{
+    int index = (int)(long)thread;
+    if (tickets == 0 || tickets > STRIDE_ONE || !initialized ||
+        index < 0 || index >= num_threads || tcb_array[index].status == EXITED) {
+        return -1;
+    }
+    lock();
+    tcb_array[index].tickets = tickets;
+    tcb_array[index].stride = STRIDE_ONE / tickets;
+    unlock();
+    return 0;
+}
+
+// Per-group CPU usage
+struct uthread_group_stats {
+    unsigned long long usage_ns;        // CPU time used by its threads and subgroups
+    unsigned long long periods;         // quota periods completed
+    unsigned long long times_throttled; // times the quota ran out
+    unsigned long long throttled_ns;    // time spent throttled
+    bool throttled;
+    int threads;                        // live threads attached directly
+};
+// Create a thread group, nested inside parent unless it is NULL. Time used
+// by a group's threads counts against its own quota and every ancestor's.
+uthread_group* uthread_group_create(uthread_group* parent)
+{
+    if (!initialized) {
+        init_threading();
+    }
+    uthread_group* group = (uthread_group*)heap_calloc(1, sizeof(uthread_group));
+    if (group == NULL) {
+        return NULL;
+    }
+    lock();
+    group->parent = parent;
+    if (parent != NULL) {
+        parent->num_children++;
+    }
+    group->next = group_list;
+    group_list = group;
+    unlock();
+    return group;
+}
+// Fails while threads are attached or subgroups exist
+int uthread_group_destroy(uthread_group* group)
+{
+    lock();
+    if (group->num_threads > 0 || group->num_children > 0) {
+        unlock();
+        return -1;
+    }
+    uthread_group** link = &group_list;
+    while (*link != group) {
+        link = &(*link)->next;
+    }
+    *link = group->next;
+    if (group->throttled) {
+        num_throttled_groups--;
+    }
+    if (group->parent != NULL) {
+        group->parent->num_children--;
+    }
+    unlock();
+    heap_free(group);
+    return 0;
+}
+// Let the group's threads run for at most quota_ns in every period_ns of
+// CLOCK_MONOTONIC (or virtual) time. Once the quota is used up they are
+// not scheduled until the period ends. A quota of 0 removes the cap.
+int uthread_group_set_quota(uthread_group* group, unsigned long long quota_ns,
+                            unsigned long long period_ns)
+{
+    if (quota_ns != 0 && (period_ns == 0 || quota_ns > period_ns)) {
+        return -1;
+    }
+    lock();
+    unsigned long long now = clock_now_ns();
+    group->quota_ns = quota_ns;
+    group->period_ns = period_ns;
+    group->period_start_ns = now;
+    group->period_usage_ns = 0;
+    if (group->throttled) {
+        group_set_throttled(group, false, now);
+    }
+    unlock();
+    return 0;
+}
+// Move a thread into a group, or out of any group if it is NULL. Threads
+// it creates later start in the same group.
+int uthread_group_attach(uthread_group* group, pthread_t thread)
+{
+    int index = (int)(long)thread;
+    if (!initialized || index < 0 || index >= num_threads ||
+        tcb_array[index].status == EXITED) {
+        return -1;
+    }
+    lock();
+    TCB* tcb = &tcb_array[index];
+    if (tcb->group != NULL) {
+        tcb->group->num_threads--;
+    }
+    tcb->group = group;
+    if (group != NULL) {
+        group->num_threads++;
+    }
+    group_requeue(index);
+    unlock();
+    return 0;
+}
+int uthread_get_group_stats(uthread_group* group, uthread_group_stats* stats)
+{
+    lock();
+    unsigned long long now = clock_now_ns();
+    group_refresh(group, now);
+    stats->usage_ns = group->usage_ns;
+    stats->periods = group->periods;
+    stats->times_throttled = group->times_throttled;
+    stats->throttled_ns = group->throttled_ns;
+    if (group->throttled) {
+        stats->throttled_ns += now - group->throttled_since_ns;
+    }
+    stats->throttled = group->throttled;
+    stats->threads = group->num_threads;
     unlock();
     return 0;
 }